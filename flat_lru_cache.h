@@ -0,0 +1,419 @@
+// Copyright (c) 2016-2017 DONGYUE.ZHANG
+// mail to zhangdy1986(at)gmail.com
+
+#ifndef SRC_UTILS_FLAT_LRU_CACHE_H_
+#define SRC_UTILS_FLAT_LRU_CACHE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "llvm_hash.hpp"
+#include "lru_cache.h"
+
+// @Author bjzhangdongyue
+// @Brief  Fixed capacity LRU cache without per-entry allocation
+// @Note   not threadsafe, need to do mutual exclusion when Get or Set
+//
+// All entries live in one array allocated by the constructor. Recency is
+// a doubly linked list of uint32 indices threaded through that array, and
+// keys are found through an open addressing index (linear probing, load
+// factor <= 0.5, backward shift deletion so no tombstones pile up). After
+// construction Get/Set never allocate, TKEY/TVALUE are assigned in place
+// and must be default constructible.
+//
+// Get/Lookup accept any key type THASH and TEQUAL can take. With the
+// StringKeyHash/StringKeyEqual pair below a std::string keyed cache is
+// probed with a const char* or a (data, size) view, no temporary string.
+
+namespace utils {
+
+/* @Brief Hash bytes of anything string like: std::string, const char*,
+ *        or a type with data() and size()
+ * */
+struct StringKeyHash {
+  size_t operator()(const char* key) const {
+    return Bytes(key, strlen(key));
+  }
+
+  template <typename S>
+  size_t operator()(const S& key) const {
+    return Bytes(key.data(), key.size());
+  }
+
+ private:
+  static size_t Bytes(const char* data, size_t len) {
+    return __murmur2_or_cityhash<size_t>()(data, len);
+  }
+};
+
+struct StringKeyEqual {
+  template <typename A, typename B>
+  bool operator()(const A& lhs, const B& rhs) const {
+    return View(lhs) == View(rhs);
+  }
+
+ private:
+  struct Bytes {
+    bool operator==(const Bytes& other) const {
+      return len == other.len && 0 == memcmp(data, other.data, len);
+    }
+
+    const char* data;
+    size_t len;
+  };
+
+  static Bytes View(const char* key) {
+    return Bytes{key, strlen(key)};
+  }
+
+  template <typename S>
+  static Bytes View(const S& key) {
+    return Bytes{key.data(), key.size()};
+  }
+};
+
+/* @Brief Counts and list ends of a FlatLRUTable. Plain data, so it may
+ *        sit in a shared memory segment next to the arrays.
+ * */
+struct FlatLRUState {
+  uint32_t size;
+  uint32_t head;  // MRU
+  uint32_t tail;  // LRU
+  uint32_t free;
+};
+
+/* @Brief Recency list and open addressing index of a flat LRU over arrays
+ *        owned by the caller: the heap for FlatLRUCache, a shared memory
+ *        segment for ShmLRUCache. Every link is an array index. Entry
+ *        needs key, prev and next members; keys are only read, the
+ *        caller stores them.
+ * */
+template <typename Entry>
+class FlatLRUTable {
+ public:
+  static const uint32_t kNil = 0xffffffffu;
+
+  /* tag is the low 32 bits of the mixed hash: it rejects most mismatches
+   * without touching the entry and gives the home slot back on delete */
+  struct Slot {
+    uint32_t entry;
+    uint32_t tag;
+  };
+
+  /* Index slots for capacity entries, load factor <= 0.5 */
+  static uint32_t IndexSize(uint32_t capacity) {
+    uint32_t index_size = 2;
+    while (index_size < capacity * 2)
+      index_size <<= 1;
+    return index_size;
+  }
+
+  FlatLRUTable()
+    : state_(nullptr), entries_(nullptr), index_(nullptr), index_mask_(0) {}
+
+  /* index has IndexSize(capacity) slots */
+  void Attach(FlatLRUState* state, Entry* entries, Slot* index,
+              uint32_t capacity) {
+    state_ = state;
+    entries_ = entries;
+    index_ = index;
+    index_mask_ = IndexSize(capacity) - 1;
+  }
+
+  /* Drop every entry, all of them go to the free list */
+  void Clear(uint32_t capacity);
+
+  /* @return index slot of key, or kNil */
+  template <typename K, typename TEQUAL>
+  uint32_t Find(const K& key, uint32_t tag, const TEQUAL& equal) const;
+
+  /* Take a free entry, link it as the MRU and index it under tag. The
+   * caller fills in key and value.
+   * @return the entry */
+  uint32_t Insert(uint32_t tag);
+
+  /* Unindex the entry at slot and return it to the free list */
+  void Delete(uint32_t slot);
+
+  /* @Breif If HIT, only adjust the recency links */
+  void Touch(uint32_t idx);
+
+  uint32_t EntryAt(uint32_t slot) const {
+    return index_[slot].entry;
+  }
+
+ private:
+  void IndexInsert(uint32_t entry, uint32_t tag);
+  void IndexErase(uint32_t slot);
+
+  void Unlink(uint32_t idx);
+  void PushFront(uint32_t idx);
+
+  FlatLRUState* state_;
+  Entry* entries_;
+  Slot* index_;
+  uint32_t index_mask_;
+};  // Class FlatLRUTable
+
+template <typename TKEY, typename TVALUE,
+          typename THASH = std::hash<TKEY>,
+          typename TEQUAL = std::equal_to<TKEY> >
+class FlatLRUCache {
+ public:
+  explicit FlatLRUCache(uint32_t capacity);
+
+  /* Same semantics as LRUCache::Get, K is TKEY or any type THASH and
+   * TEQUAL accept along with TKEY */
+  template <typename K, typename F>
+  TVALUE* Get(const K& key, F function);
+
+  template <typename K>
+  TVALUE* Get(const K& key) {
+    return Get(key, static_cast<bool(*)(const TVALUE&)>(nullptr));
+  }
+
+  /* key and value are moved into the recycled entry */
+  void Set(TKEY key, TVALUE value);
+
+  using RETURN = typename LRUCache<TKEY, TVALUE>::RETURN;
+
+  /* Same semantics as LRUCache::Lookup */
+  template <typename K, typename F>
+  typename RETURN::type Lookup(const K& key, TVALUE** value,
+                               F function);
+
+  LRUStats GetStats() const {
+    return counters_.Snapshot();
+  }
+
+  uint32_t size() const {
+    return state_.size;
+  }
+
+  uint32_t capacity() const {
+    return capacity_;
+  }
+
+  /* Bytes held by the entry array and the index, excluding whatever
+   * TKEY/TVALUE own on the heap themselves */
+  size_t MemoryBytes() const {
+    return sizeof(Entry) * capacity_ +
+        sizeof(typename Table::Slot) * Table::IndexSize(capacity_);
+  }
+
+ private:
+  FlatLRUCache(const FlatLRUCache&) = delete;
+  FlatLRUCache& operator=(const FlatLRUCache&) = delete;
+
+ private:
+  struct Entry {
+    TKEY key;
+    TVALUE value;
+    uint32_t prev;
+    uint32_t next;
+  };
+
+  using Table = FlatLRUTable<Entry>;
+
+  template <typename K>
+  uint32_t HashOf(const K& key) const {
+    return static_cast<uint32_t>(
+        LRUHashMix(static_cast<uint64_t>(hasher_(key))));
+  }
+
+  THASH hasher_;
+  TEQUAL equal_;
+  uint32_t capacity_;
+  FlatLRUState state_;
+  std::unique_ptr<Entry[]> entries_;
+  std::unique_ptr<typename Table::Slot[]> index_;
+  Table table_;
+  LRUCounters counters_;
+};  // Class FlatLRUCache
+
+template <typename Entry>
+void FlatLRUTable<Entry>::Clear(uint32_t capacity) {
+  state_->size = 0;
+  state_->head = kNil;
+  state_->tail = kNil;
+  state_->free = 0;
+  for (uint32_t i = 0; i < capacity; ++i)
+    entries_[i].next = (i + 1 < capacity) ? i + 1 : kNil;
+  for (uint32_t i = 0; i <= index_mask_; ++i)
+    index_[i].entry = kNil;
+}  // Clear
+
+template <typename Entry>
+template <typename K, typename TEQUAL>
+uint32_t FlatLRUTable<Entry>::Find(const K& key, uint32_t tag,
+                                   const TEQUAL& equal) const {
+  for (uint32_t pos = tag & index_mask_; ; pos = (pos + 1) & index_mask_) {
+    const Slot& slot = index_[pos];
+    if (kNil == slot.entry)
+      return kNil;
+    if (slot.tag == tag && equal(entries_[slot.entry].key, key))
+      return pos;
+  }
+}  // Find
+
+template <typename Entry>
+uint32_t FlatLRUTable<Entry>::Insert(uint32_t tag) {
+  uint32_t idx = state_->free;
+  state_->free = entries_[idx].next;
+  PushFront(idx);
+  IndexInsert(idx, tag);
+  ++state_->size;
+  return idx;
+}  // Insert
+
+template <typename Entry>
+void FlatLRUTable<Entry>::Delete(uint32_t slot) {
+  uint32_t idx = index_[slot].entry;
+  IndexErase(slot);
+  Unlink(idx);
+  entries_[idx].next = state_->free;
+  state_->free = idx;
+  --state_->size;
+}  // Delete
+
+template <typename Entry>
+void FlatLRUTable<Entry>::Touch(uint32_t idx) {
+  if (state_->head == idx)
+    return;
+  Unlink(idx);
+  PushFront(idx);
+}  // Touch
+
+template <typename Entry>
+void FlatLRUTable<Entry>::IndexInsert(uint32_t entry, uint32_t tag) {
+  uint32_t pos = tag & index_mask_;
+  while (kNil != index_[pos].entry)
+    pos = (pos + 1) & index_mask_;
+  index_[pos].entry = entry;
+  index_[pos].tag = tag;
+}  // IndexInsert
+
+template <typename Entry>
+void FlatLRUTable<Entry>::IndexErase(uint32_t hole) {
+  // Backward shift: pull later members of the probe run into the hole as
+  // long as that does not move them before their home slot
+  uint32_t pos = hole;
+  while (true) {
+    pos = (pos + 1) & index_mask_;
+    if (kNil == index_[pos].entry)
+      break;
+    uint32_t home = index_[pos].tag & index_mask_;
+    if (((pos - home) & index_mask_) >= ((pos - hole) & index_mask_)) {
+      index_[hole] = index_[pos];
+      hole = pos;
+    }
+  }
+  index_[hole].entry = kNil;
+}  // IndexErase
+
+template <typename Entry>
+void FlatLRUTable<Entry>::Unlink(uint32_t idx) {
+  Entry& e = entries_[idx];
+  if (kNil != e.prev)
+    entries_[e.prev].next = e.next;
+  else
+    state_->head = e.next;
+  if (kNil != e.next)
+    entries_[e.next].prev = e.prev;
+  else
+    state_->tail = e.prev;
+}  // Unlink
+
+template <typename Entry>
+void FlatLRUTable<Entry>::PushFront(uint32_t idx) {
+  Entry& e = entries_[idx];
+  e.prev = kNil;
+  e.next = state_->head;
+  if (kNil != state_->head)
+    entries_[state_->head].prev = idx;
+  else
+    state_->tail = idx;
+  state_->head = idx;
+}  // PushFront
+
+template <typename TKEY, typename TVALUE, typename THASH, typename TEQUAL>
+FlatLRUCache<TKEY, TVALUE, THASH, TEQUAL>::FlatLRUCache(uint32_t capacity)
+    : capacity_(capacity > 0 ? capacity : 1) {
+  entries_.reset(new Entry[capacity_]);
+  index_.reset(new typename Table::Slot[Table::IndexSize(capacity_)]);
+  table_.Attach(&state_, entries_.get(), index_.get(), capacity_);
+  table_.Clear(capacity_);
+}
+
+template <typename TKEY, typename TVALUE, typename THASH, typename TEQUAL>
+template <typename K, typename F>
+TVALUE* FlatLRUCache<TKEY, TVALUE, THASH, TEQUAL>::Get(const K& key,
+                                                       F function) {
+  TVALUE* value = nullptr;
+  Lookup(key, &value, function);
+  return value;
+}  // Get
+
+template <typename TKEY, typename TVALUE, typename THASH, typename TEQUAL>
+template <typename K, typename F>
+typename FlatLRUCache<TKEY, TVALUE, THASH, TEQUAL>::RETURN::type
+FlatLRUCache<TKEY, TVALUE, THASH, TEQUAL>::Lookup(const K& key,
+                                                  TVALUE** value,
+                                                  F function) {
+  uint32_t slot = table_.Find(key, HashOf(key), equal_);
+
+  if (Table::kNil == slot) {
+    counters_.Miss();
+    LRUCache<TKEY, TVALUE>::SetStatus(RETURN::MISS);
+    return RETURN::MISS;
+  }
+
+  uint32_t idx = table_.EntryAt(slot);
+  if (nullptr != function) {
+    LRUCache<TKEY, TVALUE>::SetStatus(RETURN::EXPIRED);
+    if (function(entries_[idx].value)) {
+      counters_.Expire();
+      table_.Delete(slot);
+      return RETURN::EXPIRED;
+    }
+  }
+
+  table_.Touch(idx);
+  counters_.Hit();
+  LRUCache<TKEY, TVALUE>::SetStatus(RETURN::HIT);
+
+  *value = &(entries_[idx].value);
+  return RETURN::HIT;
+}  // Lookup
+
+template <typename TKEY, typename TVALUE, typename THASH, typename TEQUAL>
+void FlatLRUCache<TKEY, TVALUE, THASH, TEQUAL>::Set(TKEY key, TVALUE value) {
+  uint32_t tag = HashOf(key);
+  uint32_t slot = table_.Find(key, tag, equal_);
+
+  if (Table::kNil != slot) {
+    table_.Touch(table_.EntryAt(slot));
+    return;
+  }
+
+  if (state_.size == capacity_) {
+    const TKEY& lru = entries_[state_.tail].key;
+    table_.Delete(table_.Find(lru, HashOf(lru), equal_));
+    counters_.Evict();
+  }
+
+  uint32_t idx = table_.Insert(tag);
+  entries_[idx].key = std::move(key);
+  entries_[idx].value = std::move(value);
+}  // Set
+
+}  // namespace utils
+
+#endif  // SRC_UTILS_FLAT_LRU_CACHE_H_
+
+/* vim :set ts=2 sts=2 sw=2 tw=80 et */
@@ -0,0 +1,125 @@
+// Copyright (c) 2016-2017 DONGYUE.ZHANG
+// mail to zhangdy1986(at)gmail.com
+
+#include <malloc.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "flat_lru_cache.h"
+#include "lru_cache.h"
+
+// @Author bjzhangdongyue
+// @Brief  ns/op and bytes/entry of FlatLRUCache against LRUCache, for
+//         integer and short string keys. Bytes are what malloc reports
+//         in use before and after the fill, so every node and bucket
+//         array is counted, not estimated.
+//
+//         usage: flat_lru_cache_bench [CAPACITY]
+//         One line per cache, key type and operation:
+//         cache key op ns_per_op bytes_per_entry
+
+namespace {
+
+const int kRounds = 4;
+
+size_t HeapBytes() {
+  return mallinfo2().uordblks;
+}
+
+std::string MakeKey(uint64_t n, std::string*) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "user:%012llu",
+           static_cast<unsigned long long>(n));
+  return buf;
+}
+
+uint64_t MakeKey(uint64_t n, uint64_t*) {
+  return n;
+}
+
+template <typename Cache, typename TKEY>
+void Run(const char* name, const char* key_name, uint32_t capacity) {
+  typedef bool (*Expired)(const uint64_t&);
+  std::vector<TKEY> keys;
+  for (uint64_t i = 0; i < capacity * 2; ++i)
+    keys.push_back(MakeKey(i, static_cast<TKEY*>(nullptr)));
+  std::vector<uint32_t> order(keys.size());
+  std::mt19937 random(1);
+  for (size_t i = 0; i < order.size(); ++i)
+    order[i] = random() % keys.size();
+
+  size_t heap_before = HeapBytes();
+  Cache cache(capacity);
+
+  // Fill: every Set inserts
+  auto start = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < capacity; ++i)
+    cache.Set(keys[i], i);
+  double fill_ns = std::chrono::duration<double, std::nano>(
+      std::chrono::steady_clock::now() - start).count() / capacity;
+  // Includes the heap of the key copies, string keys here are not SSO
+  double bytes = static_cast<double>(HeapBytes() - heap_before) / capacity;
+  printf("%s %s set_insert %.1f %.1f\n", name, key_name, fill_ns, bytes);
+
+  // Hits only
+  uint64_t sum = 0;
+  start = std::chrono::steady_clock::now();
+  for (int r = 0; r < kRounds; ++r) {
+    for (size_t i = 0; i < order.size(); ++i) {
+      uint64_t* value = cache.Get(keys[order[i] % capacity],
+                                  static_cast<Expired>(nullptr));
+      sum += nullptr != value ? *value : 0;
+    }
+  }
+  double ops = static_cast<double>(kRounds) * order.size();
+  printf("%s %s get_hit %.1f %.1f\n", name, key_name,
+         std::chrono::duration<double, std::nano>(
+             std::chrono::steady_clock::now() - start).count() / ops, bytes);
+
+  // Half of the keys miss and are inserted, evicting the LRU entry
+  start = std::chrono::steady_clock::now();
+  for (int r = 0; r < kRounds; ++r) {
+    for (size_t i = 0; i < order.size(); ++i) {
+      const TKEY& key = keys[order[i]];
+      uint64_t* value = cache.Get(key, static_cast<Expired>(nullptr));
+      if (nullptr == value)
+        cache.Set(key, order[i]);
+      else
+        sum += *value;
+    }
+  }
+  printf("%s %s get_or_set %.1f %.1f\n", name, key_name,
+         std::chrono::duration<double, std::nano>(
+             std::chrono::steady_clock::now() - start).count() / ops, bytes);
+  if (1 == sum)
+    printf("\n");  // keep the reads alive
+  fflush(stdout);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  uint32_t capacity = argc > 1 ? static_cast<uint32_t>(atoi(argv[1])) : 0;
+  if (0 == capacity)
+    capacity = 1 << 18;
+
+  printf("cache key op ns_per_op bytes_per_entry\n");
+  Run<utils::LRUCache<uint64_t, uint64_t>, uint64_t>(
+      "lru", "uint64", capacity);
+  Run<utils::FlatLRUCache<uint64_t, uint64_t>, uint64_t>(
+      "flat_lru", "uint64", capacity);
+  Run<utils::LRUCache<std::string, uint64_t>, std::string>(
+      "lru", "string", capacity);
+  Run<utils::FlatLRUCache<std::string, uint64_t, utils::StringKeyHash,
+                          utils::StringKeyEqual>, std::string>(
+      "flat_lru", "string", capacity);
+  return 0;
+}
+
+/* vim :set ts=2 sts=2 sw=2 tw=80 et */
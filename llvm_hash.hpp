@@ -1,6 +1,11 @@
 #ifndef SRC_UTILS_LLVMHASH_HPP_
 #define SRC_UTILS_LLVMHASH_HPP_
 
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+
 namespace utils {
 
 // 以下 Hash 算法来自: https://github.com/llvm-mirror/libcxx/blob/51d7e8e38165ba367882161b9b7f88e7255c65aa/include/memory
@@ -4,11 +4,20 @@
 
 #ifndef LOCKFREEQUEUE_H_ 
 #define LOCKFREEQUEUE_H_ 
+#include <algorithm>
 #include <atomic>
-#include <memory>
-#include <ctime>
+#include <cassert>
 #include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <ctime>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <thread>
 #include <type_traits>
+#include <utility>
 
 extern "C" {
 #include <pthread.h>
@@ -17,7 +26,9 @@ extern "C" {
 
 /*
  * @Author zhangdongyue
- * @Brief ThreadSafe Queue by C++11
+ * @Brief ThreadSafe Queue by C++11: LockFreeQueue for many producers and
+ *        consumers, BlockingLockFreeQueue when consumers should sleep,
+ *        SPSCQueue for one producer and one consumer
  * */
 
 #define barrier() __asm__ __volatile__("" ::: "memory")
@@ -28,7 +39,7 @@ namespace utils {
 class Semaphore {
  public:
    Semaphore(int initial_count = 0) {
-     assert(initialCount >= 0);
+     assert(initial_count >= 0);
      sem_init(&m_sema, 0, initial_count);
    }
 
@@ -60,7 +71,7 @@ class Semaphore {
      ts.tv_sec += usecs / usecs_in_1_sec;
      ts.tv_nsec += (usecs % usecs_in_1_sec) * 1000;
 
-     if (ts.tv_nsec > nsecs_in_1_sec) {
+     if (ts.tv_nsec >= nsecs_in_1_sec) {
        ts.tv_nsec -= nsecs_in_1_sec;
        ++ts.tv_sec;
      }
@@ -77,12 +88,16 @@ class Semaphore {
      sem_post(&m_sema);
    }
 
-   void single(int count) {
+   void signal(int count) {
      while (count-- > 0) {
        sem_post(&m_sema);
      }
    }
 
+   void single(int count) {
+     signal(count);
+   }
+
  private:
    sem_t m_sema;
    Semaphore(const Semaphore& other) = delete;
@@ -97,7 +112,7 @@ class LightWightSemaphore {
  public:
    LightWightSemaphore(ssize_t initial_count = 0) : 
      m_count(initial_count) {
-     assert(initial_count > 0);  
+     assert(initial_count >= 0);
    }
 
    bool tryWait() {
@@ -117,6 +132,11 @@ class LightWightSemaphore {
        waitWithPartialSpinning();
    }
 
+   /* @return false if the count stayed at zero for timeout_usecs */
+   bool wait(std::int64_t timeout_usecs) {
+     return tryWait() || waitWithPartialSpinning(timeout_usecs);
+   }
+
    ssize_t tryWaitMany(ssize_t max) {
      assert(max >= 0);
      ssize_t oldCount = m_count.load(std::memory_order_relaxed);
@@ -236,61 +256,639 @@ class LightWightSemaphore {
    }
 };  // Class LightWightSemaphore
 
+/*
+ * Bounded multi-producer multi-consumer queue (Vyukov). Every slot
+ * carries a sequence number telling whose turn it is: a producer may
+ * fill slot pos & mask when its sequence is pos, a consumer may empty it
+ * when it is pos + 1. A position is claimed with one CAS on the tail or
+ * head, which sit on cache lines of their own. Constructing or moving
+ * a T must not throw: a claimed slot is never given back.
+ * */
 template <typename T>
 class LockFreeQueue {
-  typedef size_type std::uint32_t;
   public:
-    LockFreeQueue() : i_cursor(0),i_size(0) {}
-    explicit LockFreeQueue(size_type size) : 
-      i_cursor(0),
-      i_size(size)
-    virtual ~LockFreeQueue() = default;
+    typedef std::size_t size_type;
+
+  public:
+    /* @params[in] capacity : rounded up to a power of two, at least 2 */
+    explicit LockFreeQueue(size_type capacity = 1024);
+    ~LockFreeQueue();
+
+    /* @return false if the queue is full */
+    bool try_push(const T& val) {
+      return try_emplace(val);
+    }
 
-    void pop();
-    void push(const T& val);
+    bool try_push(T&& val) {
+      return try_emplace(std::move(val));
+    }
 
-    T& front();
-    const T& front() const;
+    template <class... Args>
+    bool try_emplace(Args&&... args);
 
-    T& back();
-    const T& back() const;
+    /* Spin, yielding, until there is room */
+    void push(const T& val) {
+      emplace(val);
+    }
 
-    size_type size() const {
-      return i_size;
+    void push(T&& val) {
+      emplace(std::move(val));
     }
 
     template <class... Args>
-    void emplace(Args&&... args);
+    void emplace(Args&&... args) {
+      while (!try_emplace(std::forward<Args>(args)...))
+        std::this_thread::yield();
+    }
+
+    /* @return false if the queue is empty */
+    bool try_pop(T& val);
+
+    /* Claim up to count slots with one CAS and fill them from first, a
+     * forward iterator; use std::make_move_iterator to move. A slot
+     * whose previous item is still being popped is waited for.
+     * @return the number pushed, 0 if the queue is full */
+    template <typename It>
+    size_type try_push_bulk(It first, size_type count);
+
+    /* Push all count, spinning while the queue is full */
+    template <typename It>
+    void push_bulk(It first, size_type count) {
+      while (count > 0) {
+        size_type pushed = try_push_bulk(first, count);
+        if (0 == pushed)
+          std::this_thread::yield();
+        std::advance(first, pushed);
+        count -= pushed;
+      }
+    }
 
-    void swap(LockFreeQueue& x) noexcept;
+    /* Claim up to max items with one CAS and move them to out. An item
+     * still being pushed is waited for.
+     * @return the number popped, 0 if the queue is empty */
+    template <typename It>
+    size_type try_pop_bulk(It out, size_type max);
+
+    /* Approximate while other threads push or pop */
+    size_type size() const {
+      size_type tail = i_tail.load(std::memory_order_relaxed);
+      size_type head = i_head.load(std::memory_order_relaxed);
+      return tail > head ? tail - head : 0;
+    }
 
     bool empty() const {
       return (!size());
     }
 
-  protected:
-    std::atomic<size_type> i_cursor;
-    volatile size_type i_size;
+    size_type capacity() const {
+      return i_mask + 1;
+    }
+
+  private:
+    static const size_type kCacheLine = 64;
+
+    struct Slot {
+      std::atomic<size_type> seq;
+      typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+
+      T* value() {
+        return reinterpret_cast<T*>(&storage);
+      }
+    };
+
+    /* Claim the next position of cursor whose slot sequence is turn
+     * positions ahead of it */
+    Slot* claim(std::atomic<size_type>& cursor, size_type turn);
+
+    /* Advance cursor by up to max positions, staying within slack of
+     * bound. @return the count claimed from *first */
+    size_type claim_range(std::atomic<size_type>& cursor,
+                          const std::atomic<size_type>& bound,
+                          size_type slack, size_type max, size_type* first);
+
+    /* Spin until the slot of pos reaches seq */
+    Slot* await(size_type pos, size_type seq) {
+      Slot* slot = &i_slots[pos & i_mask];
+      while (slot->seq.load(std::memory_order_acquire) != seq)
+        std::this_thread::yield();
+      return slot;
+    }
+
+  private:
+    char i_pad0[kCacheLine];
+    std::atomic<size_type> i_tail;  // next position to push
+    char i_pad1[kCacheLine - sizeof(std::atomic<size_type>)];
+    std::atomic<size_type> i_head;  // next position to pop
+    char i_pad2[kCacheLine - sizeof(std::atomic<size_type>)];
+    size_type i_mask;
+    std::unique_ptr<Slot[]> i_slots;
 
   private:
     LockFreeQueue(const LockFreeQueue& other) = delete;
     LockFreeQueue& operator=(const LockFreeQueue& other) = delete;
+};
+
+template <typename T>
+LockFreeQueue<T>::LockFreeQueue(size_type capacity) :
+  i_tail(0),
+  i_head(0) {
+  size_type size = 2;
+  while (size < capacity)
+    size <<= 1;
+  i_mask = size - 1;
+  i_slots.reset(new Slot[size]);
+  for (size_type i = 0; i < size; ++i)
+    i_slots[i].seq.store(i, std::memory_order_relaxed);
+}
+
+template <typename T>
+LockFreeQueue<T>::~LockFreeQueue() {
+  size_type head = i_head.load(std::memory_order_relaxed);
+  size_type tail = i_tail.load(std::memory_order_relaxed);
+  for (; head != tail; ++head)
+    i_slots[head & i_mask].value()->~T();
+}
+
+template <typename T>
+typename LockFreeQueue<T>::Slot* LockFreeQueue<T>::claim(
+    std::atomic<size_type>& cursor, size_type turn) {
+  size_type pos = cursor.load(std::memory_order_relaxed);
+  while (true) {
+    Slot* slot = &i_slots[pos & i_mask];
+    size_type seq = slot->seq.load(std::memory_order_acquire);
+    std::intptr_t diff = static_cast<std::intptr_t>(seq - (pos + turn));
+    if (0 == diff) {
+      if (cursor.compare_exchange_weak(pos, pos + 1,
+                                       std::memory_order_relaxed))
+        return slot;
+    } else if (diff < 0) {
+      return nullptr;  // full for producers, empty for consumers
+    } else {
+      pos = cursor.load(std::memory_order_relaxed);
+    }
+  }
+}
+
+template <typename T>
+template <class... Args>
+bool LockFreeQueue<T>::try_emplace(Args&&... args) {
+  Slot* slot = claim(i_tail, 0);
+  if (nullptr == slot)
+    return false;
+  size_type seq = slot->seq.load(std::memory_order_relaxed);
+  new (&slot->storage) T(std::forward<Args>(args)...);
+  slot->seq.store(seq + 1, std::memory_order_release);
+  return true;
+}
+
+template <typename T>
+bool LockFreeQueue<T>::try_pop(T& val) {
+  Slot* slot = claim(i_head, 1);
+  if (nullptr == slot)
+    return false;
+  size_type seq = slot->seq.load(std::memory_order_relaxed);
+  val = std::move(*slot->value());
+  slot->value()->~T();
+  slot->seq.store(seq + i_mask, std::memory_order_release);
+  return true;
+}
+
+template <typename T>
+typename LockFreeQueue<T>::size_type LockFreeQueue<T>::claim_range(
+    std::atomic<size_type>& cursor, const std::atomic<size_type>& bound,
+    size_type slack, size_type max, size_type* first) {
+  size_type pos = cursor.load(std::memory_order_relaxed);
+  while (max > 0) {
+    std::intptr_t room = static_cast<std::intptr_t>(
+        bound.load(std::memory_order_acquire) + slack - pos);
+    if (room <= 0) {
+      size_type now = cursor.load(std::memory_order_relaxed);
+      if (now == pos)
+        return 0;
+      pos = now;  // stale, try again
+      continue;
+    }
+    size_type count = max < static_cast<size_type>(room) ? max : room;
+    if (cursor.compare_exchange_weak(pos, pos + count,
+                                     std::memory_order_relaxed)) {
+      *first = pos;
+      return count;
+    }
+  }
+  return 0;
+}
+
+template <typename T>
+template <typename It>
+typename LockFreeQueue<T>::size_type LockFreeQueue<T>::try_push_bulk(
+    It first, size_type count) {
+  size_type pos = 0;
+  count = claim_range(i_tail, i_head, capacity(), count, &pos);
+  for (size_type i = 0; i < count; ++i, ++first) {
+    Slot* slot = await(pos + i, pos + i);
+    new (&slot->storage) T(*first);
+    slot->seq.store(pos + i + 1, std::memory_order_release);
+  }
+  return count;
+}
+
+template <typename T>
+template <typename It>
+typename LockFreeQueue<T>::size_type LockFreeQueue<T>::try_pop_bulk(
+    It out, size_type max) {
+  size_type pos = 0;
+  size_type count = claim_range(i_head, i_tail, 0, max, &pos);
+  for (size_type i = 0; i < count; ++i, ++out) {
+    Slot* slot = await(pos + i, pos + i + 1);
+    *out = std::move(*slot->value());
+    slot->value()->~T();
+    slot->seq.store(pos + i + i_mask + 1, std::memory_order_release);
+  }
+  return count;
+}
+
+/*
+ * LockFreeQueue with blocking consumers. A LightWightSemaphore counts
+ * the published items: a push pays one extra atomic increment, plus a
+ * sem_post only when a consumer sleeps; a waiting pop spins briefly,
+ * then sleeps in the semaphore instead of polling. Producers never
+ * block, a full queue fails try_push.
+ * */
+template <typename T>
+class BlockingLockFreeQueue {
+  public:
+    typedef typename LockFreeQueue<T>::size_type size_type;
+
+  public:
+    explicit BlockingLockFreeQueue(size_type capacity = 1024) :
+      i_queue(capacity) {}
+
+    bool try_push(const T& val) {
+      return try_emplace(val);
+    }
+
+    bool try_push(T&& val) {
+      return try_emplace(std::move(val));
+    }
+
+    template <class... Args>
+    bool try_emplace(Args&&... args) {
+      if (!i_queue.try_emplace(std::forward<Args>(args)...))
+        return false;
+      i_items.signal();
+      return true;
+    }
+
+    /* Spin, yielding, until there is room */
+    void push(const T& val) {
+      i_queue.push(val);
+      i_items.signal();
+    }
+
+    void push(T&& val) {
+      i_queue.push(std::move(val));
+      i_items.signal();
+    }
+
+    /* Push up to count from first with one claim and one signal
+     * @return the number pushed, 0 if the queue is full */
+    template <typename It>
+    size_type try_push_bulk(It first, size_type count) {
+      size_type pushed = i_queue.try_push_bulk(first, count);
+      if (pushed > 0)
+        i_items.signal(static_cast<LightWightSemaphore::ssize_t>(pushed));
+      return pushed;
+    }
+
+    /* Push all count, spinning while the queue is full */
+    template <typename It>
+    void push_bulk(It first, size_type count) {
+      while (count > 0) {
+        size_type pushed = try_push_bulk(first, count);
+        if (0 == pushed)
+          std::this_thread::yield();
+        std::advance(first, pushed);
+        count -= pushed;
+      }
+    }
+
+    /* @return false if the queue is empty */
+    bool try_pop(T& val) {
+      if (!i_items.tryWait())
+        return false;
+      take(val);
+      return true;
+    }
+
+    /* Take up to max items without blocking
+     * @return the number stored from out */
+    template <typename It>
+    size_type try_pop_bulk(It out, size_type max) {
+      size_type count = static_cast<size_type>(i_items.tryWaitMany(
+            static_cast<LightWightSemaphore::ssize_t>(max)));
+      take_bulk(out, count);
+      return count;
+    }
+
+    /* Block until an item arrives */
+    void wait_dequeue(T& val) {
+      i_items.wait();
+      take(val);
+    }
+
+    /* @return false if nothing arrived within usecs */
+    bool wait_dequeue_timed(T& val, std::int64_t usecs) {
+      if (!i_items.wait(usecs))
+        return false;
+      take(val);
+      return true;
+    }
+
+    /* Block until at least one item arrives, then take up to max
+     * @return the number of items stored from items[0], 0 at once if
+     *         max is 0 */
+    template <typename It>
+    size_type wait_dequeue_bulk(It items, size_type max) {
+      if (0 == max)
+        return 0;
+      size_type count = static_cast<size_type>(i_items.waitMany(
+            static_cast<LightWightSemaphore::ssize_t>(max)));
+      take_bulk(items, count);
+      return count;
+    }
+
+    /* As wait_dequeue_bulk, 0 if nothing arrived within usecs */
+    template <typename It>
+    size_type wait_dequeue_bulk_timed(It items, size_type max,
+                                      std::int64_t usecs) {
+      if (0 == max)
+        return 0;
+      size_type count = static_cast<size_type>(i_items.waitMany(
+            static_cast<LightWightSemaphore::ssize_t>(max), usecs));
+      take_bulk(items, count);
+      return count;
+    }
+
+    size_type size_approx() const {
+      return static_cast<size_type>(i_items.availableApprox());
+    }
+
+  private:
+    /* Pop an item the semaphore vouched for. A producer that claimed an
+     * earlier slot may still be filling it, wait for it. */
+    void take(T& val) {
+      while (!i_queue.try_pop(val))
+        std::this_thread::yield();
+    }
+
+    template <typename It>
+    void take_bulk(It out, size_type count) {
+      while (count > 0) {
+        size_type popped = i_queue.try_pop_bulk(out, count);
+        if (0 == popped)
+          std::this_thread::yield();
+        std::advance(out, popped);
+        count -= popped;
+      }
+    }
+
+  private:
+    LockFreeQueue<T> i_queue;
+    LightWightSemaphore i_items;
+
+  private:
+    BlockingLockFreeQueue(const BlockingLockFreeQueue& other) = delete;
+    BlockingLockFreeQueue& operator=(const BlockingLockFreeQueue& other) = delete;
+};
+
+/*
+ * Bounded single-producer single-consumer queue, wait-free. Each side
+ * owns one index and publishes it with a release store; the other
+ * side's index is cached and only reloaded when the cached view runs out
+ * of room or items, so the two cache lines are rarely shared. Slots are
+ * raw storage, an item lives from its construction in a slot to
+ * commit_read: write_span / commit_write construct items in place,
+ * read_span / commit_read consume them in place, without copies.
+ * */
+template <typename T>
+class SPSCQueue {
+  public:
+    typedef std::size_t size_type;
+
+  public:
+    /* @params[in] capacity : rounded up to a power of two, at least 2 */
+    explicit SPSCQueue(size_type capacity = 1024);
+    ~SPSCQueue();
+
+    /* The indexes are cache line aligned, plain new only is from C++17 */
+    static void* operator new(std::size_t size) {
+      void* addr = nullptr;
+      if (0 != posix_memalign(&addr, kCacheLine, size))
+        throw std::bad_alloc();
+      return addr;
+    }
+
+    static void operator delete(void* addr) {
+      free(addr);
+    }
+
+    /* Producer only. @return false if the queue is full */
+    bool try_push(const T& val) {
+      return try_emplace(val);
+    }
+
+    bool try_push(T&& val) {
+      return try_emplace(std::move(val));
+    }
+
+    template <class... Args>
+    bool try_emplace(Args&&... args) {
+      T* slot = nullptr;
+      if (0 == write_span(&slot, 1))
+        return false;
+      new (slot) T(std::forward<Args>(args)...);
+      commit_write(1);
+      return true;
+    }
+
+    /* Consumer only. @return false if the queue is empty */
+    bool try_pop(T& val) {
+      T* slot = nullptr;
+      if (0 == read_span(&slot, 1))
+        return false;
+      val = std::move(*slot);
+      commit_read(1);
+      return true;
+    }
+
+    /* Producer only: copy up to count from first, one release store per
+     * contiguous run
+     * @return the number pushed */
+    template <typename It>
+    size_type try_push_bulk(It first, size_type count);
+
+    /* Consumer only: move up to max items to out
+     * @return the number popped */
+    template <typename It>
+    size_type try_pop_bulk(It out, size_type max);
+
+    /* Producer only: up to max free slots, contiguous from *data, not
+     * constructed. Construct items in the first ones with placement new,
+     * then commit_write them. The consumer's index is reloaded only when
+     * the cached view has fewer than max slots, or none when max exceeds
+     * the capacity, so an unbounded span may be short of what is free.
+     * @return the number of slots, 0 if the queue is full */
+    size_type write_span(T** data, size_type max = ~size_type(0));
+    void commit_write(size_type count) {
+      i_tail.store(i_tail.load(std::memory_order_relaxed) + count,
+                   std::memory_order_release);
+    }
+
+    /* Consumer only: up to max items, contiguous from *data, cached view
+     * as in write_span. Use them, then commit_read the ones consumed,
+     * which destroys them.
+     * @return the number of items, 0 if the queue is empty */
+    size_type read_span(T** data, size_type max = ~size_type(0));
+    void commit_read(size_type count) {
+      size_type head = i_head.load(std::memory_order_relaxed);
+      for (size_type i = 0; i < count; ++i)
+        at(head + i)->~T();
+      i_head.store(head + count, std::memory_order_release);
+    }
+
+    /* Approximate unless called by the producer or the consumer */
+    size_type size() const {
+      size_type tail = i_tail.load(std::memory_order_acquire);
+      size_type head = i_head.load(std::memory_order_acquire);
+      return tail > head ? tail - head : 0;
+    }
+
+    bool empty() const {
+      return (!size());
+    }
+
+    size_type capacity() const {
+      return i_mask + 1;
+    }
+
+  private:
+    static const size_type kCacheLine = 64;
+
+    typedef typename std::aligned_storage<sizeof(T), alignof(T)>::type
+      Storage;
+
+    T* at(size_type pos) {
+      return reinterpret_cast<T*>(&i_slots[pos & i_mask]);
+    }
+
+    /* Contiguous part of count slots from pos, without wrapping */
+    size_type contiguous(size_type pos, size_type count) const {
+      size_type to_end = capacity() - (pos & i_mask);
+      return count < to_end ? count : to_end;
+    }
+
+    /* Least count that is worth reloading the other side's index for */
+    size_type wanted(size_type max) const {
+      return max <= capacity() ? max : 1;
+    }
+
+  private:
+    // Each side's index and its cache of the other's share a line
+    alignas(kCacheLine) std::atomic<size_type> i_tail;  // producer
+    size_type i_head_cache;
+    alignas(kCacheLine) std::atomic<size_type> i_head;  // consumer
+    size_type i_tail_cache;
+    alignas(kCacheLine) size_type i_mask;
+    std::unique_ptr<Storage[]> i_slots;
+
+  private:
+    SPSCQueue(const SPSCQueue& other) = delete;
+    SPSCQueue& operator=(const SPSCQueue& other) = delete;
+};
+
+template <typename T>
+SPSCQueue<T>::SPSCQueue(size_type capacity) :
+  i_tail(0),
+  i_head_cache(0),
+  i_head(0),
+  i_tail_cache(0) {
+  size_type size = 2;
+  while (size < capacity)
+    size <<= 1;
+  i_mask = size - 1;
+  i_slots.reset(new Storage[size]);
+}
+
+template <typename T>
+SPSCQueue<T>::~SPSCQueue() {
+  size_type head = i_head.load(std::memory_order_relaxed);
+  size_type tail = i_tail.load(std::memory_order_relaxed);
+  for (; head != tail; ++head)
+    at(head)->~T();
+}
+
+template <typename T>
+typename SPSCQueue<T>::size_type SPSCQueue<T>::write_span(
+    T** data, size_type max) {
+  size_type tail = i_tail.load(std::memory_order_relaxed);
+  size_type room = capacity() - (tail - i_head_cache);
+  if (room < wanted(max)) {
+    i_head_cache = i_head.load(std::memory_order_acquire);
+    room = capacity() - (tail - i_head_cache);
+  }
+  size_type count = contiguous(tail, room < max ? room : max);
+  *data = at(tail);
+  return count;
+}
+
+template <typename T>
+typename SPSCQueue<T>::size_type SPSCQueue<T>::read_span(
+    T** data, size_type max) {
+  size_type head = i_head.load(std::memory_order_relaxed);
+  size_type ready = i_tail_cache - head;
+  if (ready < wanted(max)) {
+    i_tail_cache = i_tail.load(std::memory_order_acquire);
+    ready = i_tail_cache - head;
+  }
+  size_type count = contiguous(head, ready < max ? ready : max);
+  *data = at(head);
+  return count;
 }
 
 template <typename T>
-void LockFreeQueue<T>::pop() {
-  --i_cursor;
+template <typename It>
+typename SPSCQueue<T>::size_type SPSCQueue<T>::try_push_bulk(
+    It first, size_type count) {
+  size_type pushed = 0;
+  T* data = nullptr;
+  // Two spans when the free slots wrap around
+  for (int part = 0; part < 2 && pushed < count; ++part) {
+    size_type n = write_span(&data, count - pushed);
+    if (0 == n)
+      break;
+    for (size_type i = 0; i < n; ++i, ++first)
+      new (data + i) T(*first);
+    pushed += n;
+    commit_write(n);
+  }
+  return pushed;
 }
 
 template <typename T>
-void LockFreeQueue<T>::push(const T& val) {
-  do {
-    ++i_cursor;
-    size_type idx = i_cursor;
-  } while (!atomic_compare_exchange_strong(i_cursor, idx, idx))
-
-  // TODO
-  container[i_cursor] = val;
+template <typename It>
+typename SPSCQueue<T>::size_type SPSCQueue<T>::try_pop_bulk(
+    It out, size_type max) {
+  size_type popped = 0;
+  T* data = nullptr;
+  for (int part = 0; part < 2 && popped < max; ++part) {
+    size_type n = read_span(&data, max - popped);
+    if (0 == n)
+      break;
+    out = std::move(data, data + n, out);
+    popped += n;
+    commit_read(n);
+  }
+  return popped;
 }
 
 }  // namespace utils
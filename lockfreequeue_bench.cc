@@ -0,0 +1,166 @@
+//====================================================
+// Copyright (c) Dongyue.Zippy (zhangdy1986@gmail.com)
+//====================================================
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "lockfreequeue.h"
+
+// @Brief Single against bulk operations on SPSCQueue, LockFreeQueue and
+//        BlockingLockFreeQueue. Producers hand over bursts of items and
+//        consumers take up to a burst at a time, once with one call per
+//        item (try_push / try_pop / wait_dequeue_timed) and once with one
+//        call per burst (the _bulk variants). SPSCQueue runs one producer
+//        and one consumer, the others THREADS of each.
+//
+//        usage: lockfreequeue_bench [THREADS [BURST...]]
+//        One line per queue, api and burst size:
+//        queue api threads burst items_per_sec
+
+namespace {
+
+const std::size_t kCapacity = 4096;
+const std::uint64_t kItemsPerProducer = 1 << 21;
+const std::int64_t kWaitUsecs = 1000;
+
+typedef utils::SPSCQueue<std::uint64_t> Spsc;
+typedef utils::LockFreeQueue<std::uint64_t> Mpmc;
+typedef utils::BlockingLockFreeQueue<std::uint64_t> Blocking;
+
+template <typename It>
+void PushBurst(Spsc* queue, It first, std::size_t count, bool bulk) {
+  while (count > 0) {
+    std::size_t pushed = 0;
+    if (bulk) {
+      pushed = queue->try_push_bulk(first, count);
+    } else if (queue->try_push(*first)) {
+      pushed = 1;
+    }
+    if (0 == pushed)
+      std::this_thread::yield();
+    first += pushed;
+    count -= pushed;
+  }
+}
+
+template <typename Queue, typename It>
+void PushBurst(Queue* queue, It first, std::size_t count, bool bulk) {
+  if (bulk) {
+    queue->push_bulk(first, count);
+    return;
+  }
+  for (std::size_t i = 0; i < count; ++i)
+    queue->push(first[i]);
+}
+
+/* @return the number taken into out, up to max */
+template <typename Queue>
+std::size_t PopBurst(Queue* queue, std::uint64_t* out, std::size_t max,
+                     bool bulk) {
+  if (bulk)
+    return queue->try_pop_bulk(out, max);
+  std::size_t count = 0;
+  while (count < max && queue->try_pop(out[count]))
+    ++count;
+  return count;
+}
+
+std::size_t PopBurst(Blocking* queue, std::uint64_t* out, std::size_t max,
+                     bool bulk) {
+  if (bulk)
+    return queue->wait_dequeue_bulk_timed(out, max, kWaitUsecs);
+  if (!queue->wait_dequeue_timed(out[0], kWaitUsecs))
+    return 0;
+  std::size_t count = 1;
+  while (count < max && queue->try_pop(out[count]))
+    ++count;
+  return count;
+}
+
+template <typename Queue>
+void Run(const char* name, bool bulk, int threads, std::size_t burst) {
+  Queue queue(kCapacity);
+  std::uint64_t total = kItemsPerProducer * threads;
+  std::atomic<std::uint64_t> popped(0);
+  std::atomic<std::uint64_t> checksum(0);
+
+  std::vector<std::thread> workers;
+  auto start = std::chrono::steady_clock::now();
+  for (int t = 0; t < threads; ++t) {
+    workers.push_back(std::thread([&queue, bulk, burst, t]() {
+      std::vector<std::uint64_t> items(burst);
+      std::uint64_t next = t * kItemsPerProducer;
+      std::uint64_t end = next + kItemsPerProducer;
+      while (next < end) {
+        std::size_t count = end - next < burst ? end - next : burst;
+        for (std::size_t i = 0; i < count; ++i)
+          items[i] = next++;
+        PushBurst(&queue, items.begin(), count, bulk);
+      }
+    }));
+    workers.push_back(std::thread([&queue, &popped, &checksum, bulk, burst,
+                                   total]() {
+      std::vector<std::uint64_t> items(burst);
+      std::uint64_t sum = 0;
+      while (popped.load(std::memory_order_relaxed) < total) {
+        std::size_t count = PopBurst(&queue, &items[0], burst, bulk);
+        if (0 == count) {
+          std::this_thread::yield();
+          continue;
+        }
+        for (std::size_t i = 0; i < count; ++i)
+          sum += items[i];
+        popped.fetch_add(count, std::memory_order_relaxed);
+      }
+      checksum.fetch_add(sum, std::memory_order_relaxed);
+    }));
+  }
+  for (std::size_t t = 0; t < workers.size(); ++t)
+    workers[t].join();
+  double seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+
+  if (checksum.load() != total * (total - 1) / 2)
+    std::cerr << name << ": items lost or duplicated" << std::endl;
+  std::printf("%s %s %d %zu %.0f\n", name, bulk ? "bulk" : "single", threads,
+              burst, total / seconds);
+  std::fflush(stdout);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  int threads = argc > 1 ? std::atoi(argv[1]) : 0;
+  if (threads < 1) {
+    threads = static_cast<int>(std::thread::hardware_concurrency()) / 2;
+    threads = threads > 0 ? threads : 1;
+  }
+  std::vector<std::size_t> bursts;
+  for (int i = 2; i < argc; ++i) {
+    if (std::atoi(argv[i]) > 0)
+      bursts.push_back(std::atoi(argv[i]));
+  }
+  if (bursts.empty()) {
+    for (std::size_t burst = 64; burst <= 1024; burst *= 4)
+      bursts.push_back(burst);
+  }
+
+  std::printf("queue api threads burst items_per_sec\n");
+  for (std::size_t i = 0; i < bursts.size(); ++i) {
+    for (int bulk = 0; bulk < 2; ++bulk) {
+      Run<Spsc>("spsc", bulk, 1, bursts[i]);
+      Run<Mpmc>("mpmc", bulk, threads, bursts[i]);
+      Run<Blocking>("blocking", bulk, threads, bursts[i]);
+    }
+  }
+  return 0;
+}
+
+/* vim: set ts=2 sw=2 sts=2 tw=88 et */
@@ -0,0 +1,285 @@
+/*====================================================
+ * Copyright (c) 2015-2016 ZIPPY.Z All Rights Reserved.
+ *====================================================*/
+#ifndef SRC_UTILS_LOG_BINARY_H_
+#define SRC_UTILS_LOG_BINARY_H_
+
+#include<atomic>
+#include<cstddef>
+#include<cstdint>
+#include<cstring>
+#include<sstream>
+#include<string>
+#include<type_traits>
+#include<utility>
+
+// @Author dongyue.zhang(zhangdy1986(at)gmail.com)
+// @Brief Deferred formatting log stream, see Logger::PrintDeferred.
+//
+// A call site is described by a site frame: id, severity, source line
+// and file, and for every argument either its type or, for a string
+// literal, the text itself. It goes out with the first record of the
+// site and again at the start of every later file of the logger. Every
+// call then only writes a record frame: site id, time, and the raw bytes
+// of the non literal arguments. Ids are only unique within a process, a
+// file holds the sites of all its records and is decoded on its own.
+// log_decoder puts the text back together offline.
+//
+// frame  := kind(1) varint(payload length) payload
+// site   := varint id, varint severity, varint line, string file,
+//           varint nargs, nargs x (type(1) [string if kLogArgText])
+// record := varint id, varint time, one value per non text argument
+// string := varint length, bytes
+//
+// A string literal is recognised as a const char array argument, a const
+// char array filled at run time would be frozen at its first value.
+
+namespace utils {
+
+enum LogFrameType {
+  kLogSiteFrame = 'S',
+  kLogRecordFrame = 'R',
+};
+
+enum LogArgType {
+  kLogArgText = 0,  // literal, lives in the site frame
+  kLogArgInt,       // zigzag varint
+  kLogArgUint,      // varint
+  kLogArgDouble,    // 8 bytes
+  kLogArgString,    // string
+  kLogArgChar,      // 1 byte
+  kLogArgBool,      // 1 byte
+  kLogArgPointer,   // varint
+};
+
+/* One per LOGGER_DEFER call site, a function local static */
+struct LogSite {
+  LogSite(const char* file, int line, int severity)
+    : file(file), line(line), severity(severity), id(0), defined_for(0) {}
+
+  /* Process wide id, assigned on first use. Another run numbers its
+   * sites again from 1. */
+  uint32_t Id() {
+    uint32_t current = id.load(std::memory_order_acquire);
+    if (0 == current) {
+      static std::atomic<uint32_t> next_id(0);
+      uint32_t fresh = ++next_id;
+      current = id.compare_exchange_strong(current, fresh) ? fresh : current;
+    }
+    return current;
+  }
+
+  const char* file;
+  int line;
+  int severity;
+  std::atomic<uint32_t> id;
+  std::atomic<uint64_t> defined_for;  // logger whose stream has the site
+};
+
+inline void AppendLogVarint(std::string* out, uint64_t value) {
+  while (value >= 0x80) {
+    out->push_back(static_cast<char>(value | 0x80));
+    value >>= 7;
+  }
+  out->push_back(static_cast<char>(value));
+}
+
+inline void AppendLogString(std::string* out, const char* data, size_t len) {
+  AppendLogVarint(out, len);
+  out->append(data, len);
+}
+
+inline void AppendLogFrame(std::string* out, LogFrameType type,
+                           const std::string& payload) {
+  out->push_back(static_cast<char>(type));
+  AppendLogVarint(out, payload.size());
+  out->append(payload);
+}
+
+/* @return false on truncated input */
+inline bool ReadLogVarint(const char** pos, const char* end, uint64_t* value) {
+  *value = 0;
+  for (int shift = 0; *pos < end && shift < 64; shift += 7) {
+    uint8_t byte = static_cast<uint8_t>(*(*pos)++);
+    *value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if (0 == (byte & 0x80))
+      return true;
+  }
+  return false;
+}
+
+inline bool ReadLogString(const char** pos, const char* end,
+                          std::string* value) {
+  uint64_t len = 0;
+  if (!ReadLogVarint(pos, end, &len) ||
+      static_cast<uint64_t>(end - *pos) < len)
+    return false;
+  value->assign(*pos, len);
+  *pos += len;
+  return true;
+}
+
+/* Describe appends the site frame part of an argument, Encode the record
+ * part. Types without a codec are formatted with operator<< right away. */
+template<typename T, typename Enable = void>
+struct LogArgCodec {
+  static void Describe(std::string* out, const T&) {
+    out->push_back(kLogArgString);
+  }
+  static void Encode(std::string* out, const T& value) {
+    std::ostringstream stream;
+    stream << value;
+    const std::string& text = stream.str();
+    AppendLogString(out, text.data(), text.size());
+  }
+};
+
+template<typename T>
+struct LogArgCodec<T, typename std::enable_if<
+    std::is_integral<T>::value && std::is_signed<T>::value &&
+    sizeof(T) != 1>::type> {
+  static void Describe(std::string* out, const T&) {
+    out->push_back(kLogArgInt);
+  }
+  static void Encode(std::string* out, const T& value) {
+    int64_t v = value;
+    AppendLogVarint(out, (static_cast<uint64_t>(v) << 1) ^
+                         static_cast<uint64_t>(v >> 63));
+  }
+};
+
+template<typename T>
+struct LogArgCodec<T, typename std::enable_if<
+    std::is_integral<T>::value && std::is_unsigned<T>::value &&
+    sizeof(T) != 1 && !std::is_same<T, bool>::value>::type> {
+  static void Describe(std::string* out, const T&) {
+    out->push_back(kLogArgUint);
+  }
+  static void Encode(std::string* out, const T& value) {
+    AppendLogVarint(out, value);
+  }
+};
+
+/* char, signed char and unsigned char print as characters */
+template<typename T>
+struct LogArgCodec<T, typename std::enable_if<
+    std::is_integral<T>::value && sizeof(T) == 1 &&
+    !std::is_same<T, bool>::value>::type> {
+  static void Describe(std::string* out, const T&) {
+    out->push_back(kLogArgChar);
+  }
+  static void Encode(std::string* out, const T& value) {
+    out->push_back(static_cast<char>(value));
+  }
+};
+
+template<>
+struct LogArgCodec<bool> {
+  static void Describe(std::string* out, bool) {
+    out->push_back(kLogArgBool);
+  }
+  static void Encode(std::string* out, bool value) {
+    out->push_back(value ? 1 : 0);
+  }
+};
+
+template<typename T>
+struct LogArgCodec<T, typename std::enable_if<
+    std::is_floating_point<T>::value>::type> {
+  static void Describe(std::string* out, const T&) {
+    out->push_back(kLogArgDouble);
+  }
+  static void Encode(std::string* out, const T& value) {
+    double v = value;
+    out->append(reinterpret_cast<const char*>(&v), sizeof(v));
+  }
+};
+
+template<>
+struct LogArgCodec<std::string> {
+  static void Describe(std::string* out, const std::string&) {
+    out->push_back(kLogArgString);
+  }
+  static void Encode(std::string* out, const std::string& value) {
+    AppendLogString(out, value.data(), value.size());
+  }
+};
+
+template<typename T>
+struct LogArgCodec<T*> {
+  static void Describe(std::string* out, T*) {
+    out->push_back(kLogArgPointer);
+  }
+  static void Encode(std::string* out, T* value) {
+    AppendLogVarint(out, reinterpret_cast<uintptr_t>(value));
+  }
+};
+
+template<>
+struct LogArgCodec<const char*> {
+  static void Describe(std::string* out, const char*) {
+    out->push_back(kLogArgString);
+  }
+  static void Encode(std::string* out, const char* value) {
+    AppendLogString(out, value, value ? strlen(value) : 0);
+  }
+};
+
+template<>
+struct LogArgCodec<char*> : LogArgCodec<const char*> {};
+
+/* A char buffer filled at run time */
+template<size_t N>
+struct LogArgCodec<char[N]> {
+  static void Describe(std::string* out, const char (&)[N]) {
+    out->push_back(kLogArgString);
+  }
+  static void Encode(std::string* out, const char (&value)[N]) {
+    AppendLogString(out, value, strnlen(value, N));
+  }
+};
+
+/* A string literal */
+template<size_t N>
+struct LogArgCodec<const char[N]> {
+  static void Describe(std::string* out, const char (&value)[N]) {
+    out->push_back(kLogArgText);
+    AppendLogString(out, value, strnlen(value, N));
+  }
+  static void Encode(std::string*, const char (&)[N]) {}
+};
+
+/* Codec key of a forwarded argument: cv and reference dropped, except
+ * the const of char arrays that tells literals apart */
+template<typename T>
+struct LogArgKey {
+  typedef typename std::remove_cv<
+      typename std::remove_reference<T>::type>::type type;
+};
+
+template<size_t N>
+struct LogArgKey<const char (&)[N]> {
+  typedef const char type[N];
+};
+
+inline void DescribeLogArgs(std::string*) {}
+
+template<typename TFirst, typename...TRest>
+void DescribeLogArgs(std::string* out, TFirst&& first, TRest&&...rest) {
+  LogArgCodec<typename LogArgKey<TFirst>::type>::Describe(out, first);
+  DescribeLogArgs(out, std::forward<TRest>(rest)...);
+}
+
+inline void EncodeLogArgs(std::string*) {}
+
+template<typename TFirst, typename...TRest>
+void EncodeLogArgs(std::string* out, TFirst&& first, TRest&&...rest) {
+  LogArgCodec<typename LogArgKey<TFirst>::type>::Encode(out, first);
+  EncodeLogArgs(out, std::forward<TRest>(rest)...);
+}
+
+}  // namespace utils
+
+#endif  // SRC_UTILS_LOG_BINARY_H_
+
+/* vim: set ts=2 sts=2 sw=2 tw=80 et */
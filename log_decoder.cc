@@ -0,0 +1,318 @@
+/*====================================================
+ * Copyright (c) 2015-2016 ZIPPY.Z All Rights Reserved.
+ *====================================================*/
+#include<fcntl.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<unistd.h>
+#include<zlib.h>
+
+#include<cstdio>
+#include<cstring>
+#include<iostream>
+#include<sstream>
+#include<string>
+#include<unordered_map>
+#include<utility>
+#include<vector>
+
+#include "log_binary.h"
+#include "logging.h"
+
+// @Author dongyue.zhang(zhangdy1986(at)gmail.com)
+// @Brief Turns Logger::PrintDeferred files back into the text lines Print
+//        would have written. Every file carries the sites of its records
+//        and is decoded on its own, site ids are not compared across
+//        files, which may come from different runs. Pass them oldest first
+//        for one line numbering. Works on FileLogPolicy and
+//        MmapFileLogPolicy output, and on files LogRotator gzipped
+//        (name ending in .gz).
+//
+//        usage: log_decoder FILE...
+
+namespace {
+
+struct Site {
+  uint64_t severity;
+  uint64_t line;
+  std::string file;
+  std::vector<std::pair<uint8_t, std::string> > args;  // type, literal text
+};
+
+typedef std::unordered_map<uint64_t, Site> SiteMap;
+
+/* A log file in memory: mapped, or inflated when the name ends in .gz */
+class LogFile {
+ public:
+  explicit LogFile(const std::string& path)
+    : _addr(nullptr), _size(0), _mapped(false), _ok(false) {
+    if (path.size() > 3 && 0 == path.compare(path.size() - 3, 3, ".gz")) {
+      Inflate(path);
+    } else {
+      Map(path);
+    }
+  }
+
+  ~LogFile() {
+    if (_mapped) {
+      munmap(const_cast<char*>(_addr), _size);
+    }
+  }
+
+  bool ok() const { return _ok; }
+  const char* begin() const { return _addr; }
+  const char* end() const { return _addr + _size; }
+
+ private:
+  void Map(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return;
+    }
+    struct stat st;
+    if (0 == fstat(fd, &st)) {
+      _ok = true;
+      if (st.st_size > 0) {
+        void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        _ok = MAP_FAILED != addr;
+        if (_ok) {
+          _addr = static_cast<const char*>(addr);
+          _size = st.st_size;
+          _mapped = true;
+        }
+      }
+    }
+    close(fd);
+  }
+
+  void Inflate(const std::string& path) {
+    gzFile in = gzopen(path.c_str(), "rb");
+    if (nullptr == in) {
+      return;
+    }
+    char buffer[64 * 1024];
+    int n = 0;
+    while ((n = gzread(in, buffer, sizeof(buffer))) > 0) {
+      _inflated.append(buffer, n);
+    }
+    // A truncated or corrupt stream: keep the frames that did inflate
+    _ok = 0 == n;
+    gzclose(in);
+    _addr = _inflated.data();
+    _size = _inflated.size();
+  }
+
+  const char* _addr;
+  size_t _size;
+  bool _mapped;
+  bool _ok;
+  std::string _inflated;
+};
+
+const char* SeverityTag(uint64_t severity) {
+  switch (severity) {
+    case utils::debug:
+      return "[DEBUG]\t";
+    case utils::error:
+      return "[ERROR]\t";
+    case utils::warning:
+      return "[WARNING]\t";
+    default:
+      return "";
+  }
+}
+
+bool ReadSite(const char* pos, const char* end, SiteMap* sites) {
+  uint64_t id = 0;
+  uint64_t nargs = 0;
+  Site site;
+  if (!utils::ReadLogVarint(&pos, end, &id) ||
+      !utils::ReadLogVarint(&pos, end, &site.severity) ||
+      !utils::ReadLogVarint(&pos, end, &site.line) ||
+      !utils::ReadLogString(&pos, end, &site.file) ||
+      !utils::ReadLogVarint(&pos, end, &nargs)) {
+    return false;
+  }
+  for (uint64_t i = 0; i < nargs; ++i) {
+    if (pos >= end) {
+      return false;
+    }
+    std::pair<uint8_t, std::string> arg(static_cast<uint8_t>(*pos++), "");
+    if (utils::kLogArgText == arg.first &&
+        !utils::ReadLogString(&pos, end, &arg.second)) {
+      return false;
+    }
+    site.args.push_back(arg);
+  }
+  (*sites)[id] = site;
+  return true;
+}
+
+bool FormatArg(uint8_t type, const char** pos, const char* end,
+               std::ostream& out) {
+  uint64_t value = 0;
+  std::string text;
+  switch (type) {
+    case utils::kLogArgInt:
+      if (!utils::ReadLogVarint(pos, end, &value)) {
+        return false;
+      }
+      out << static_cast<int64_t>((value >> 1) ^ (~(value & 1) + 1));
+      return true;
+    case utils::kLogArgUint:
+      if (!utils::ReadLogVarint(pos, end, &value)) {
+        return false;
+      }
+      out << value;
+      return true;
+    case utils::kLogArgDouble: {
+      double v = 0;
+      if (static_cast<size_t>(end - *pos) < sizeof(v)) {
+        return false;
+      }
+      memcpy(&v, *pos, sizeof(v));
+      *pos += sizeof(v);
+      out << v;
+      return true;
+    }
+    case utils::kLogArgString:
+      if (!utils::ReadLogString(pos, end, &text)) {
+        return false;
+      }
+      out << text;
+      return true;
+    case utils::kLogArgChar:
+    case utils::kLogArgBool:
+      if (*pos >= end) {
+        return false;
+      }
+      if (utils::kLogArgChar == type) {
+        out << **pos;
+      } else {
+        out << (0 != **pos);
+      }
+      ++*pos;
+      return true;
+    case utils::kLogArgPointer:
+      if (!utils::ReadLogVarint(pos, end, &value)) {
+        return false;
+      }
+      out << reinterpret_cast<const void*>(static_cast<uintptr_t>(value));
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool PrintRecord(const char* pos, const char* end, const SiteMap& sites,
+                 uint64_t line_number, std::string* line) {
+  uint64_t id = 0;
+  uint64_t timestamp = 0;
+  if (!utils::ReadLogVarint(&pos, end, &id) ||
+      !utils::ReadLogVarint(&pos, end, &timestamp)) {
+    return false;
+  }
+  SiteMap::const_iterator it = sites.find(id);
+  if (it == sites.end()) {
+    return false;
+  }
+
+  char header[64];
+  char* head = utils::FormatLogUint(header, line_number, 7);
+  *head++ = '\t';
+  *head++ = '[';
+  head = utils::FormatLogTime(head, static_cast<time_t>(timestamp));
+  memcpy(head, "-0000000]\t", 10);
+  head += 10;
+
+  std::ostringstream body;
+  body << SeverityTag(it->second.severity);
+  for (size_t i = 0; i < it->second.args.size(); ++i) {
+    const std::pair<uint8_t, std::string>& arg = it->second.args[i];
+    if (utils::kLogArgText == arg.first) {
+      body << arg.second;
+    } else if (!FormatArg(arg.first, &pos, end, body)) {
+      return false;
+    }
+  }
+  line->assign(header, head - header);
+  line->append(body.str());
+  line->push_back('\n');
+  return true;
+}
+
+/* Walk the frames of one file, calling visit(type, payload, end) */
+template<typename F>
+bool ForEachFrame(const char* path, const LogFile& file, F visit) {
+  const char* pos = file.begin();
+  const char* end = file.end();
+  // A MmapFileLogPolicy file left by a crash ends in zeros
+  while (pos < end && 0 != *pos) {
+    char type = *pos++;
+    uint64_t len = 0;
+    if (!utils::ReadLogVarint(&pos, end, &len) ||
+        static_cast<uint64_t>(end - pos) < len ||
+        (utils::kLogSiteFrame != type && utils::kLogRecordFrame != type)) {
+      std::cerr << path << ": corrupt frame at offset "
+        << pos - file.begin() << std::endl;
+      return false;
+    }
+    if (!visit(type, pos, pos + len)) {
+      std::cerr << path << ": bad " << type << " frame at offset "
+        << pos - file.begin() << std::endl;
+      return false;
+    }
+    pos += len;
+  }
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    std::cerr << "usage: " << argv[0] << " FILE..." << std::endl;
+    return 2;
+  }
+
+  uint64_t line_number = 0;
+  std::string line;
+  int status = 0;
+  for (int i = 1; i < argc; ++i) {
+    LogFile file(argv[i]);
+    if (!file.ok()) {
+      std::cerr << argv[i] << ": unable to read" << std::endl;
+      status = 1;
+      if (file.begin() == file.end()) {
+        continue;
+      }
+    }
+
+    // Buffered per thread output can put a record before its site, so
+    // collect the sites of the file first
+    SiteMap sites;
+    if (!ForEachFrame(argv[i], file,
+          [&sites](char type, const char* pos, const char* end) {
+            return utils::kLogSiteFrame != type || ReadSite(pos, end, &sites);
+          })) {
+      status = 1;
+    }
+    if (!ForEachFrame(argv[i], file,
+          [&](char type, const char* pos, const char* end) {
+            if (utils::kLogRecordFrame != type) {
+              return true;
+            }
+            if (!PrintRecord(pos, end, sites, line_number, &line)) {
+              return false;
+            }
+            ++line_number;
+            fwrite(line.data(), 1, line.size(), stdout);
+            return true;
+          })) {
+      status = 1;
+    }
+  }
+  return status;
+}
+
+/* vim: set ts=2 sts=2 sw=2 tw=80 et */
@@ -0,0 +1,99 @@
+/*====================================================
+ * Copyright (c) 2015-2016 ZIPPY.Z All Rights Reserved.
+ *====================================================*/
+#ifndef SRC_UTILS_LOG_LIMIT_H_
+#define SRC_UTILS_LOG_LIMIT_H_
+#include<time.h>
+
+#include<atomic>
+#include<cstdint>
+
+// @Author dongyue.zhang(zhangdy1986(at)gmail.com)
+// @Brief Per call site rate limit and sampling, see UTILS_LOG_LIMITED.
+//        Every site owns a LogLimiter as a function local static. Its
+//        constructor is constexpr, so the static needs no guard and a
+//        check is a few relaxed atomics on the site's own cache line,
+//        no lock.
+
+namespace utils {
+
+class LogLimiter {
+ public:
+    /* @params[in] per_second : calls logged per second, 0 for no limit
+     * @params[in] one_in : log one call out of one_in, 0 or 1 logs all
+     * */
+    constexpr LogLimiter(uint32_t per_second, uint32_t one_in)
+      : _per_second(per_second), _one_in(one_in),
+        _calls(0), _window(0), _suppressed(0), _reported(0) {}
+
+    /* Calls left out by sampling are expected and not counted. Calls
+     * dropped by the rate limit are, and reported at most once a second
+     * by whichever call of the site comes first, dropped or not: a storm
+     * is reported while it lasts, its last second by the next call.
+     * @params[out] suppressed : rate limited calls to report now, 0 if
+     *              none
+     * @return true if the call may log */
+    bool Allow(time_t now, uint64_t* suppressed) {
+      *suppressed = 0;
+      if (_one_in > 1 &&
+          0 != _calls.fetch_add(1, std::memory_order_relaxed) % _one_in) {
+        return false;
+      }
+      uint32_t second = static_cast<uint32_t>(now);
+      bool allowed = 0 == _per_second || Admit(second);
+      if (!allowed) {
+        _suppressed.fetch_add(1, std::memory_order_relaxed);
+      }
+      if (0 != _suppressed.load(std::memory_order_relaxed)) {
+        *suppressed = Report(second);
+      }
+      return allowed;
+    }
+
+ private:
+    LogLimiter(const LogLimiter&) = delete;
+    LogLimiter& operator=(const LogLimiter&) = delete;
+
+    /* @return the count to report, 0 if this second already had a report
+     * or another call took it */
+    uint64_t Report(uint32_t second) {
+      uint32_t last = _reported.load(std::memory_order_relaxed);
+      if (last == second || !_reported.compare_exchange_strong(last, second,
+            std::memory_order_relaxed)) {
+        return 0;
+      }
+      return _suppressed.exchange(0, std::memory_order_relaxed);
+    }
+
+    /* _window holds the current second and the calls seen in it. Calls
+     * racing over a second boundary may be counted in either second. */
+    bool Admit(uint32_t second) {
+      uint64_t window = _window.load(std::memory_order_relaxed);
+      while (window >> 32 != second) {
+        if (_window.compare_exchange_weak(window,
+              static_cast<uint64_t>(second) << 32 | 1,
+              std::memory_order_relaxed)) {
+          return true;
+        }
+      }
+      if ((window & 0xffffffff) >= _per_second) {
+        return false;  // a storm only reads the window
+      }
+      window = _window.fetch_add(1, std::memory_order_relaxed);
+      return (window & 0xffffffff) < _per_second;
+    }
+
+ private:
+    const uint32_t _per_second;
+    const uint32_t _one_in;
+    std::atomic<uint64_t> _calls;
+    std::atomic<uint64_t> _window;  // second << 32 | calls in it
+    std::atomic<uint64_t> _suppressed;  // rate limited, not reported yet
+    std::atomic<uint32_t> _reported;  // second of the last report
+};
+
+}  // namespace utils
+
+#endif  // SRC_UTILS_LOG_LIMIT_H_
+
+/* vim: set ts=2 sts=2 sw=2 tw=80 et */
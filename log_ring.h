@@ -0,0 +1,142 @@
+/*====================================================
+ * Copyright (c) 2015-2016 ZIPPY.Z All Rights Reserved.
+ *====================================================*/
+#ifndef SRC_UTILS_LOG_RING_H_
+#define SRC_UTILS_LOG_RING_H_
+#include<time.h>
+
+#include<atomic>
+#include<cstddef>
+#include<cstdint>
+#include<cstring>
+#include<memory>
+#include<string>
+
+// @Author dongyue.zhang(zhangdy1986(at)gmail.com)
+// @Brief Bounded ring of preformatted log records, many producers, one
+//        consumer. Every slot carries a sequence number (Vyukov style):
+//        a producer claims a position with one CAS on the tail, copies
+//        the record in and publishes it by bumping the slot sequence.
+//        Records longer than the slot payload spill to the heap.
+
+namespace utils {
+
+class LogRing {
+ public:
+    /* @params[in] capacity : rounded up to a power of two */
+    explicit LogRing(size_t capacity);
+    ~LogRing();
+
+    /* @return false if the ring is full */
+    bool TryPush(const char* data, size_t len, time_t timestamp);
+
+    /* Consumer only: append the oldest record to out
+     * @return false if the ring is empty */
+    bool TryPop(std::string* out, time_t* timestamp);
+
+    /* Approximate number of queued records */
+    size_t Size() const {
+      uint64_t tail = _tail.load(std::memory_order_relaxed);
+      uint64_t head = _head.load(std::memory_order_relaxed);
+      return tail > head ? static_cast<size_t>(tail - head) : 0;
+    }
+
+    size_t Capacity() const {
+      return _mask + 1;
+    }
+
+ private:
+    LogRing(const LogRing&) = delete;
+    LogRing& operator=(const LogRing&) = delete;
+
+ private:
+    static const size_t kInlineBytes = 224;  // 256 byte slots on LP64
+    static const size_t kCacheLine = 64;
+
+    struct Slot {
+      std::atomic<uint64_t> seq;
+      time_t timestamp;
+      uint32_t len;
+      std::string* spill;
+      char data[kInlineBytes];
+    };
+
+    std::unique_ptr<Slot[]> _slots;
+    size_t _mask;
+    char _pad0[kCacheLine];
+    std::atomic<uint64_t> _tail;  // next position to claim, producers
+    char _pad1[kCacheLine - sizeof(std::atomic<uint64_t>)];
+    std::atomic<uint64_t> _head;  // next position to read, consumer
+    char _pad2[kCacheLine - sizeof(std::atomic<uint64_t>)];
+};
+
+inline LogRing::LogRing(size_t capacity) : _tail(0), _head(0) {
+  size_t size = 2;
+  while (size < capacity)
+    size <<= 1;
+  _mask = size - 1;
+  _slots.reset(new Slot[size]);
+  for (size_t i = 0; i < size; ++i) {
+    _slots[i].seq.store(i, std::memory_order_relaxed);
+    _slots[i].spill = nullptr;
+  }
+}
+
+inline LogRing::~LogRing() {
+  for (size_t i = 0; i <= _mask; ++i)
+    delete _slots[i].spill;
+}
+
+inline bool LogRing::TryPush(const char* data, size_t len, time_t timestamp) {
+  uint64_t pos = _tail.load(std::memory_order_relaxed);
+  Slot* slot;
+  while (true) {
+    slot = &_slots[pos & _mask];
+    uint64_t seq = slot->seq.load(std::memory_order_acquire);
+    int64_t diff = static_cast<int64_t>(seq - pos);
+    if (0 == diff) {
+      if (_tail.compare_exchange_weak(pos, pos + 1,
+                                      std::memory_order_relaxed))
+        break;
+    } else if (diff < 0) {
+      return false;
+    } else {
+      pos = _tail.load(std::memory_order_relaxed);
+    }
+  }
+
+  slot->timestamp = timestamp;
+  slot->len = static_cast<uint32_t>(len);
+  if (len <= sizeof(slot->data)) {
+    memcpy(slot->data, data, len);
+  } else {
+    slot->spill = new std::string(data, len);
+  }
+  slot->seq.store(pos + 1, std::memory_order_release);
+  return true;
+}
+
+inline bool LogRing::TryPop(std::string* out, time_t* timestamp) {
+  uint64_t pos = _head.load(std::memory_order_relaxed);
+  Slot* slot = &_slots[pos & _mask];
+  if (slot->seq.load(std::memory_order_acquire) != pos + 1)
+    return false;
+
+  *timestamp = slot->timestamp;
+  if (nullptr != slot->spill) {
+    out->append(*slot->spill);
+    delete slot->spill;
+    slot->spill = nullptr;
+  } else {
+    out->append(slot->data, slot->len);
+  }
+  slot->seq.store(pos + _mask + 1, std::memory_order_release);
+  _head.store(pos + 1, std::memory_order_relaxed);
+  return true;
+}
+
+}  // namespace utils
+
+#endif  // SRC_UTILS_LOG_RING_H_
+
+/* vim: set ts=2 sts=2 sw=2 tw=80 et */
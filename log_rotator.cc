@@ -0,0 +1,300 @@
+/*====================================================
+ * Copyright (c) 2015-2016 ZIPPY.Z All Rights Reserved.
+ *====================================================*/
+#include "log_rotator.h"
+
+#include<dirent.h>
+#include<errno.h>
+#include<fcntl.h>
+#include<sys/resource.h>
+#include<sys/stat.h>
+#include<sys/syscall.h>
+#include<unistd.h>
+#include<zlib.h>
+
+#include<algorithm>
+#include<sstream>
+#include<vector>
+
+// @Author dongyue.zhang(zhangdy1986(at)gmail.com)
+// @Brief Background log rotation, see log_rotator.h
+
+namespace utils {
+
+namespace {
+
+const char kSpareTag[] = ".next.";
+
+std::string UniqueName(const std::string& name, int attempt) {
+  if (0 == attempt) {
+    return name;
+  }
+  std::ostringstream stream;
+  stream << name << '.' << attempt;
+  return stream.str();
+}
+
+std::string BaseName(const std::string& path) {
+  return path.substr(path.rfind('/') + 1);
+}
+
+/* A compressed file keeps its name, plus .gz */
+bool Compressed(const std::string& name) {
+  return 0 == access((name + ".gz").c_str(), F_OK);
+}
+
+/* Give path the first free one of name, name.1, ... without replacing */
+std::string LinkUnique(const std::string& path, const std::string& name) {
+  for (int attempt = 0; attempt < 1000; ++attempt) {
+    std::string target = UniqueName(name, attempt);
+    if (Compressed(target)) {
+      continue;
+    }
+    if (0 == link(path.c_str(), target.c_str())) {
+      unlink(path.c_str());
+      return target;
+    }
+    if (EEXIST != errno) {
+      break;
+    }
+  }
+  // No hard links here, settle for a rename
+  rename(path.c_str(), name.c_str());
+  return name;
+}
+
+}  // namespace
+
+int OpenUniqueLogFile(const std::string& name, int flags, std::string* path) {
+  for (int attempt = 0; attempt < 1000; ++attempt) {
+    *path = UniqueName(name, attempt);
+    if (Compressed(*path)) {
+      continue;
+    }
+    int fd = open(path->c_str(), flags | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd >= 0 || EEXIST != errno) {
+      return fd;
+    }
+  }
+  return -1;
+}
+
+LogRotator::LogRotator(const std::string& prefix, int flags,
+                       const LogRotateOptions& options)
+    : _prefix(prefix),
+      _flags(flags),
+      _options(options),
+      _spare_fd(-1),
+      _stop(false) {
+  _thread = std::thread(&LogRotator::Run, this);
+}
+
+LogRotator::~LogRotator() {
+  {
+    std::lock_guard<std::mutex> guard(_mutex);
+    _stop = true;
+  }
+  _cv.notify_one();
+  _thread.join();
+
+  if (_spare_fd >= 0) {
+    close(_spare_fd);
+    unlink(_spare_path.c_str());
+  }
+}
+
+int LogRotator::Rotate(int old_fd, const std::string& name) {
+  Job job = { old_fd, name, "" };
+  int fd = -1;
+  {
+    // An inline file is created and queued in one go, so Retain never
+    // sees it on disk without its job
+    std::lock_guard<std::mutex> guard(_mutex);
+    if (_spare_fd >= 0) {
+      fd = _spare_fd;
+      _spare_fd = -1;
+      job.spare_path.swap(_spare_path);
+    } else {
+      fd = OpenUniqueLogFile(name, _flags, &job.name);
+    }
+    _jobs.push_back(job);
+  }
+  _cv.notify_one();
+  return fd;
+}
+
+void LogRotator::Run() {
+  // Compression and deletes must not compete with the service threads
+  setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), 19);
+
+  std::unique_lock<std::mutex> guard(_mutex);
+  bool try_spare = true;
+  while (true) {
+    while (!_jobs.empty()) {
+      Job job = _jobs.front();
+      _jobs.pop_front();
+      guard.unlock();
+      Handle(job);
+      guard.lock();
+    }
+    if (_stop) {
+      break;
+    }
+    if (_spare_fd < 0 && try_spare) {
+      // After a failure the writer opens inline until the next rotation
+      try_spare = false;
+      guard.unlock();
+      OpenSpare();
+      guard.lock();
+      continue;
+    }
+    _cv.wait(guard);
+    try_spare = true;
+  }
+}
+
+void LogRotator::OpenSpare() {
+  std::ostringstream stream;
+  stream << _prefix << kSpareTag << getpid();
+  std::string path;
+  int fd = OpenUniqueLogFile(stream.str(), _flags, &path);
+  std::lock_guard<std::mutex> guard(_mutex);
+  _spare_fd = fd;
+  _spare_path = path;
+}
+
+void LogRotator::Handle(const Job& job) {
+  std::string old_path = _current;
+  _current = job.spare_path.empty() ? job.name
+      : LinkUnique(job.spare_path, job.name);
+
+  if (job.old_fd < 0) {
+    return;
+  }
+  close(job.old_fd);
+  if (_options.compress && !old_path.empty()) {
+    Compress(old_path);
+  }
+  if (_options.max_files > 0 || _options.max_total_bytes > 0) {
+    Retain();
+  }
+}
+
+void LogRotator::Compress(const std::string& path) {
+  int in = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (in < 0) {
+    return;
+  }
+  std::string tmp_path = path + ".gz.tmp";
+  gzFile out = gzopen(tmp_path.c_str(), "wb");
+  bool ok = nullptr != out;
+
+  std::vector<char> buffer(256 * 1024);
+  while (ok) {
+    ssize_t n = read(in, &buffer[0], buffer.size());
+    if (n < 0 && EINTR == errno) {
+      continue;
+    }
+    if (n <= 0) {
+      ok = 0 == n;
+      break;
+    }
+    ok = gzwrite(out, &buffer[0], static_cast<unsigned>(n)) == n;
+  }
+  close(in);
+
+  if (nullptr != out && Z_OK != gzclose(out)) {
+    ok = false;
+  }
+  if (ok && 0 == rename(tmp_path.c_str(), (path + ".gz").c_str())) {
+    unlink(path.c_str());
+  } else {
+    unlink(tmp_path.c_str());
+  }
+}
+
+void LogRotator::Retain() {
+  std::string::size_type slash = _prefix.rfind('/');
+  std::string dir = std::string::npos == slash ? "." : _prefix.substr(0, slash);
+  std::string base = std::string::npos == slash ? _prefix
+      : _prefix.substr(slash + 1);
+  if (dir.empty()) {
+    dir = "/";
+  }
+
+  DIR* handle = opendir(dir.c_str());
+  if (nullptr == handle) {
+    return;
+  }
+
+  struct File {
+    struct timespec mtime;
+    uint64_t size;
+    std::string path;
+  };
+  std::vector<File> files;
+  std::string current = BaseName(_current);
+  while (struct dirent* entry = readdir(handle)) {
+    std::string name = entry->d_name;
+    if (0 != name.compare(0, base.size(), base) || name == current ||
+        0 == name.compare(base.size(), sizeof(kSpareTag) - 1, kSpareTag) ||
+        (name.size() > 7 &&
+         0 == name.compare(name.size() - 7, 7, ".gz.tmp"))) {
+      continue;
+    }
+    File file;
+    file.path = dir + "/" + name;
+    struct stat st;
+    if (0 != stat(file.path.c_str(), &st) || !S_ISREG(st.st_mode)) {
+      continue;
+    }
+    file.mtime = st.st_mtim;
+    file.size = st.st_size;
+    files.push_back(file);
+  }
+  closedir(handle);
+
+  // Files the writer moved to after the job being handled
+  std::vector<std::string> pending;
+  {
+    std::lock_guard<std::mutex> guard(_mutex);
+    for (size_t i = 0; i < _jobs.size(); ++i) {
+      if (_jobs[i].spare_path.empty()) {
+        pending.push_back(BaseName(_jobs[i].name));
+      }
+    }
+  }
+  files.erase(std::remove_if(files.begin(), files.end(),
+        [&pending](const File& file) {
+          return pending.end() !=
+              std::find(pending.begin(), pending.end(), BaseName(file.path));
+        }), files.end());
+
+  // Oldest first. Same second rotations only differ in the nanoseconds.
+  std::sort(files.begin(), files.end(), [](const File& a, const File& b) {
+    if (a.mtime.tv_sec != b.mtime.tv_sec) {
+      return a.mtime.tv_sec < b.mtime.tv_sec;
+    }
+    return a.mtime.tv_nsec < b.mtime.tv_nsec;
+  });
+
+  uint64_t total = 0;
+  for (size_t i = 0; i < files.size(); ++i) {
+    total += files[i].size;
+  }
+  for (size_t i = 0; i < files.size(); ++i) {
+    size_t left = files.size() - i;
+    bool too_many = _options.max_files > 0 && left > _options.max_files;
+    bool too_big = _options.max_total_bytes > 0 &&
+        total > _options.max_total_bytes;
+    if (!too_many && !too_big) {
+      break;
+    }
+    unlink(files[i].path.c_str());
+    total -= files[i].size;
+  }
+}
+
+}  // namespace utils
+
+/* vim: set ts=2 sts=2 sw=2 tw=80 et */
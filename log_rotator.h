@@ -0,0 +1,95 @@
+/*====================================================
+ * Copyright (c) 2015-2016 ZIPPY.Z All Rights Reserved.
+ *====================================================*/
+#ifndef SRC_UTILS_LOG_ROTATOR_H_
+#define SRC_UTILS_LOG_ROTATOR_H_
+
+#include<condition_variable>
+#include<cstdint>
+#include<deque>
+#include<mutex>
+#include<string>
+#include<thread>
+
+// @Author dongyue.zhang(zhangdy1986(at)gmail.com)
+// @Brief Log file rotation work moved off the write path. A background
+//        thread keeps the next file open under a temporary name, so the
+//        writer rotates by swapping file descriptors. The thread then
+//        names the new file, closes the old one, optionally gzips it at
+//        low priority, and deletes the oldest rotated files beyond the
+//        retention limits.
+
+namespace utils {
+
+struct LogRotateOptions {
+  LogRotateOptions() : compress(false), max_files(0), max_total_bytes(0) {}
+
+  bool compress;             // gzip rotated files to <name>.gz
+  size_t max_files;          // rotated files kept, 0 keeps all
+  uint64_t max_total_bytes;  // their total size, 0 for no limit
+};
+
+/* Create a file that does not exist yet: name, then name.1, name.2 ...
+ * @params[out] path : the name used
+ * @return fd, -1 on failure
+ * */
+int OpenUniqueLogFile(const std::string& name, int flags, std::string* path);
+
+class LogRotator {
+ public:
+    /* @params[in] prefix : log name prefix, files of this logger start
+     *            with it, retention only looks at those
+     * @params[in] flags : open(2) flags of a new file, O_CREAT | O_EXCL
+     *            are added
+     * */
+    LogRotator(const std::string& prefix, int flags,
+               const LogRotateOptions& options);
+
+    /* Finishes queued work, removes the unused spare file */
+    ~LogRotator();
+
+    /* Switch the writer from old_fd to a new file called name. Closing,
+     * naming and compressing happen in the background.
+     * @params[in] old_fd : -1 for the first file
+     * @return the pre-opened spare, or if none is ready a file opened
+     *         right here; -1 on failure
+     * */
+    int Rotate(int old_fd, const std::string& name);
+
+ private:
+    LogRotator(const LogRotator&) = delete;
+    LogRotator& operator=(const LogRotator&) = delete;
+
+ private:
+    struct Job {
+      int old_fd;
+      std::string name;
+      std::string spare_path;  // file to rename to name, empty if inline
+    };
+
+    void Run();
+    void Handle(const Job& job);
+    void OpenSpare();
+    void Compress(const std::string& path);
+    void Retain();
+
+ private:
+    std::string _prefix;
+    int _flags;
+    LogRotateOptions _options;
+
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::deque<Job> _jobs;
+    int _spare_fd;
+    std::string _spare_path;
+    std::string _current;  // thread only, file being written
+    bool _stop;
+    std::thread _thread;
+};
+
+}  // namespace utils
+
+#endif  // SRC_UTILS_LOG_ROTATOR_H_
+
+/* vim: set ts=2 sts=2 sw=2 tw=80 et */
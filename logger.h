@@ -8,24 +8,68 @@
 #include "gflags/gflags.h"
 
 // @Author dongyue.zhang(zhangdy1986(at)gmail.com)
-// @Brief Log print, thread safe, TODO(zdy): no buffering
+// @Brief Log print, thread safe. Writes inline by default, call
+//        log_inst.StartAsync() or log_inst.StartBuffered() once flags
+//        are parsed to move the writes to a background thread.
 
 DEFINE_string(binlog_prefix, "./mylog_", "log prefix");
+DEFINE_string(deferlog_prefix, "./mydeferlog_",
+    "deferred log prefix, decode the files with log_decoder");
 
 using ::utils::Logger;
 using ::utils::FileLogPolicy;
 using ::utils::SeverityType;
 static Logger<FileLogPolicy> log_inst(FLAGS_binlog_prefix);
 
-#define LOGGER       log_inst.Print<SeverityType::debug>
-#define LOGGER_ERR   log_inst.Print<SeverityType::error>
-#define LOGGER_WARN  log_inst.Print<SeverityType::warning>
+// Built by the first LOGGER_DEFER call, one for the whole program, so
+// code that never defers opens no file and starts no thread for it
+inline Logger<FileLogPolicy>& LogDeferInst() {
+  static Logger<FileLogPolicy> inst(FLAGS_deferlog_prefix);
+  return inst;
+}
+
+// Filtered by UTILS_LOG_MIN_LEVEL and log_inst.SetMinLevel() before the
+// arguments are evaluated
+#define LOGGER(...)      UTILS_LOG(log_inst, SeverityType::debug, __VA_ARGS__)
+#define LOGGER_ERR(...)  UTILS_LOG(log_inst, SeverityType::error, __VA_ARGS__)
+#define LOGGER_WARN(...) \
+  UTILS_LOG(log_inst, SeverityType::warning, __VA_ARGS__)
 #define LOGGER_BIN   log_inst.PrintBinary
 
+// Rate limited and sampled per call site, for logs that can storm:
+// LOGGER_ERR_RATE(10, ...) prints the first 10 calls of every second,
+// LOGGER_SAMPLE(100, ...) one call in 100. Sampling is silent, calls over
+// the rate are counted in a "suppressed N messages" line, at most one a
+// second per call site.
+#define LOGGER_RATE(n, ...) \
+  UTILS_LOG_LIMITED(log_inst, SeverityType::debug, n, 0, __VA_ARGS__)
+#define LOGGER_ERR_RATE(n, ...) \
+  UTILS_LOG_LIMITED(log_inst, SeverityType::error, n, 0, __VA_ARGS__)
+#define LOGGER_WARN_RATE(n, ...) \
+  UTILS_LOG_LIMITED(log_inst, SeverityType::warning, n, 0, __VA_ARGS__)
+#define LOGGER_SAMPLE(k, ...) \
+  UTILS_LOG_LIMITED(log_inst, SeverityType::debug, 0, k, __VA_ARGS__)
+#define LOGGER_ERR_SAMPLE(k, ...) \
+  UTILS_LOG_LIMITED(log_inst, SeverityType::error, 0, k, __VA_ARGS__)
+#define LOGGER_WARN_SAMPLE(k, ...) \
+  UTILS_LOG_LIMITED(log_inst, SeverityType::warning, 0, k, __VA_ARGS__)
+
+// Deferred formatting into LogDeferInst(), for the hottest debug logs
+#define LOGGER_DEFER_AT(severity, ...) do { \
+    if (LogDeferInst().Enabled<severity>()) { \
+      static ::utils::LogSite log_site(__FILE__, __LINE__, severity); \
+      LogDeferInst().PrintDeferred(log_site, __VA_ARGS__); \
+    } \
+  } while (0)
+#define LOGGER_DEFER(...)      LOGGER_DEFER_AT(SeverityType::debug, __VA_ARGS__)
+#define LOGGER_DEFER_ERR(...)  LOGGER_DEFER_AT(SeverityType::error, __VA_ARGS__)
+#define LOGGER_DEFER_WARN(...) \
+  LOGGER_DEFER_AT(SeverityType::warning, __VA_ARGS__)
+
 #ifdef RANK_LOG_DEBUG
-#define ELOGGER      log_inst.Print<SeverityType::debug>
-#define ELOGGER_ERR  log_inst.Print<SeverityType::error>
-#define ELOGGER_WARN log_inst.Print<SeverityType::warning>
+#define ELOGGER      LOGGER
+#define ELOGGER_ERR  LOGGER_ERR
+#define ELOGGER_WARN LOGGER_WARN
 #define ELOGGER_BIN  log_inst.PrintBinary
 #endif
 
@@ -0,0 +1,244 @@
+/*====================================================
+ * Copyright (c) 2015-2016 ZIPPY.Z All Rights Reserved.
+ *====================================================*/
+#include<dirent.h>
+#include<sys/vfs.h>
+#include<unistd.h>
+
+#include<algorithm>
+#include<chrono>
+#include<cstdio>
+#include<cstdlib>
+#include<cstring>
+#include<functional>
+#include<iostream>
+#include<sstream>
+#include<string>
+#include<thread>
+#include<vector>
+
+#include "logging.h"
+
+// @Author dongyue.zhang(zhangdy1986(at)gmail.com)
+// @Brief Throughput and caller latency of Logger<FileLogPolicy>, for every
+//        combination of output directory, mode (inline under _write_mutex,
+//        async ring, per-thread buffers), API (UTILS_LOG, which the LOGGER
+//        macros expand to, Print and PrintBinary), thread count and
+//        message size. Throughput runs until the logger is destroyed, so
+//        every message is on its way to the file; latency is the time of
+//        each call on the caller's thread. Log files are removed after
+//        each run.
+//
+//        usage: logger_bench [-t THREADS,...] [-s BYTES,...] [DIR...]
+//        Defaults: threads 1 to 64, sizes 16,128,1024, and /dev/shm
+//        against the current directory for tmpfs against disk.
+//        One JSON object per line and run:
+//        {"dir":D,"fs":"tmpfs"|"disk","mode":M,"api":A,"threads":T,
+//         "msg_bytes":B,"msgs":N,"msgs_per_sec":R,"p50_ns":X,"p99_ns":Y,
+//         "p999_ns":Z,"max_ns":W}
+
+namespace {
+
+const int kMessages = 1 << 18;  // per run, split over the threads
+const long kTmpfsMagic = 0x01021994;
+
+enum Mode {
+  mode_sync = 0,
+  mode_async,
+  mode_buffered,
+  mode_count,
+};
+
+const char* const kModeNames[mode_count] = {
+  "sync", "async", "buffered",
+};
+
+enum Api {
+  api_macro = 0,
+  api_print,
+  api_binary,
+  api_count,
+};
+
+const char* const kApiNames[api_count] = {
+  "macro", "print", "binary",
+};
+
+typedef utils::Logger<utils::FileLogPolicy> BenchLogger;
+
+struct Run {
+  std::string dir;
+  Mode mode;
+  Api api;
+  int threads;
+  int bytes;
+};
+
+/* "1,2,4" to {1, 2, 4}, skipping what is not a positive number */
+std::vector<int> ParseList(const char* text) {
+  std::vector<int> values;
+  std::istringstream stream(text);
+  std::string item;
+  while (std::getline(stream, item, ',')) {
+    if (atoi(item.c_str()) > 0) {
+      values.push_back(atoi(item.c_str()));
+    }
+  }
+  return values;
+}
+
+const char* FileSystemName(const std::string& dir) {
+  struct statfs st;
+  if (0 == statfs(dir.c_str(), &st) &&
+      kTmpfsMagic == static_cast<long>(st.f_type)) {
+    return "tmpfs";
+  }
+  return "disk";
+}
+
+/* Delete the files of one run, they all start with prefix */
+void RemoveLogs(const std::string& dir, const std::string& prefix) {
+  DIR* handle = opendir(dir.c_str());
+  if (nullptr == handle) {
+    return;
+  }
+  while (struct dirent* entry = readdir(handle)) {
+    if (0 == strncmp(entry->d_name, prefix.c_str(), prefix.size())) {
+      unlink((dir + "/" + entry->d_name).c_str());
+    }
+  }
+  closedir(handle);
+}
+
+/* count calls of one thread, the duration of each into latency */
+void Produce(BenchLogger* logger, Api api, int thread,
+             const std::string& message, int count,
+             std::vector<uint32_t>* latency) {
+  typedef std::chrono::steady_clock Clock;
+  const char* text = message.c_str();
+  latency->reserve(count);
+  for (int i = 0; i < count; ++i) {
+    Clock::time_point start = Clock::now();
+    if (api_macro == api) {
+      UTILS_LOG(*logger, utils::SeverityType::debug,
+          "thread=", thread, " seq=", i, ' ', text);
+    } else if (api_print == api) {
+      logger->Print<utils::SeverityType::debug>(text);
+    } else {
+      logger->PrintBinary(text, message.size());
+    }
+    latency->push_back(static_cast<uint32_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+          Clock::now() - start).count()));
+  }
+}
+
+void Measure(const Run& run) {
+  std::ostringstream prefix;
+  prefix << "logger_bench_" << kModeNames[run.mode] << '_'
+    << kApiNames[run.api] << '_' << run.threads << '_' << run.bytes << '_';
+  int per_thread = kMessages / run.threads;
+  std::string message(run.bytes, 'x');
+  if (api_binary == run.api) {
+    message[run.bytes - 1] = '\n';
+  }
+  std::vector<std::vector<uint32_t> > latency(run.threads);
+
+  std::chrono::steady_clock::time_point start =
+    std::chrono::steady_clock::now();
+  {
+    BenchLogger logger(run.dir + "/" + prefix.str());
+    if (mode_async == run.mode) {
+      logger.StartAsync(64 * 1024);
+    } else if (mode_buffered == run.mode) {
+      logger.StartBuffered();
+    }
+
+    std::vector<std::thread> workers;
+    for (int t = 0; t < run.threads; ++t) {
+      workers.push_back(std::thread(Produce, &logger, run.api, t,
+            std::cref(message), per_thread, &latency[t]));
+    }
+    for (size_t t = 0; t < workers.size(); ++t) {
+      workers[t].join();
+    }
+  }
+  double seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+  RemoveLogs(run.dir, prefix.str());
+
+  std::vector<uint32_t> all;
+  all.reserve(per_thread * run.threads);
+  for (size_t t = 0; t < latency.size(); ++t) {
+    all.insert(all.end(), latency[t].begin(), latency[t].end());
+  }
+  std::sort(all.begin(), all.end());
+  size_t n = all.size();
+
+  printf("{\"dir\":\"%s\",\"fs\":\"%s\",\"mode\":\"%s\",\"api\":\"%s\","
+         "\"threads\":%d,\"msg_bytes\":%d,\"msgs\":%zu,"
+         "\"msgs_per_sec\":%.0f,\"p50_ns\":%u,\"p99_ns\":%u,"
+         "\"p999_ns\":%u,\"max_ns\":%u}\n",
+         run.dir.c_str(), FileSystemName(run.dir), kModeNames[run.mode],
+         kApiNames[run.api], run.threads, run.bytes, n, n / seconds,
+         all[n / 2], all[n * 99 / 100], all[n * 999 / 1000], all[n - 1]);
+  fflush(stdout);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  std::vector<int> threads;
+  std::vector<int> sizes;
+  std::vector<std::string> dirs;
+  for (int i = 1; i < argc; ++i) {
+    if (0 == strcmp(argv[i], "-t") && i + 1 < argc) {
+      threads = ParseList(argv[++i]);
+    } else if (0 == strcmp(argv[i], "-s") && i + 1 < argc) {
+      sizes = ParseList(argv[++i]);
+    } else {
+      dirs.push_back(argv[i]);
+    }
+  }
+  if (threads.empty()) {
+    for (int n = 1; n <= 64; n *= 2) {
+      threads.push_back(n);
+    }
+  }
+  if (sizes.empty()) {
+    sizes.push_back(16);
+    sizes.push_back(128);
+    sizes.push_back(1024);
+  }
+  if (dirs.empty()) {
+    dirs.push_back("/dev/shm");
+    dirs.push_back(".");
+  }
+  for (size_t i = 0; i < dirs.size(); ++i) {
+    if (0 != access(dirs[i].c_str(), W_OK)) {
+      std::cerr << dirs[i] << ": not a writable directory" << std::endl;
+      return 2;
+    }
+  }
+
+  Run run;
+  for (size_t d = 0; d < dirs.size(); ++d) {
+    run.dir = dirs[d];
+    for (int mode = 0; mode < mode_count; ++mode) {
+      run.mode = static_cast<Mode>(mode);
+      for (int api = 0; api < api_count; ++api) {
+        run.api = static_cast<Api>(api);
+        for (size_t t = 0; t < threads.size(); ++t) {
+          run.threads = threads[t];
+          for (size_t s = 0; s < sizes.size(); ++s) {
+            run.bytes = sizes[s];
+            Measure(run);
+          }
+        }
+      }
+    }
+  }
+  return 0;
+}
+
+/* vim: set ts=2 sts=2 sw=2 tw=80 et */
@@ -3,33 +3,105 @@
  *====================================================*/
 #include "logging.h"
 
+#include<errno.h>
+#include<fcntl.h>
+#include<limits.h>
+#include<sys/mman.h>
+
+#include<algorithm>
+#include<cstring>
+
 // @Author dongyue.zhang(zhangdy1986(at)gmail.com)
 // @Brief Logging print interface
 
 namespace utils {
 
-int32_t FileLogPolicy::_kMainThreadPid = getpid();
-int32_t FileLogPolicy::_kMainDay = 0;
+char* FormatLogUint(char* out, uint64_t value, int width) {
+  char digits[20];
+  int len = 0;
+  do {
+    digits[len++] = static_cast<char>('0' + value % 10);
+    value /= 10;
+  } while (value > 0);
+  for (int i = len; i < width; ++i) {
+    *out++ = '0';
+  }
+  while (len > 0) {
+    *out++ = digits[--len];
+  }
+  return out;
+}
+
+namespace {
+
+struct LogTimeCache {
+  LogTimeCache() : valid(false), second(0), minute(0) {}
+
+  bool valid;
+  time_t second;
+  time_t minute;  // first second of the cached minute
+  char text[15];
+};
+
+inline void Put2(char* out, int value) {
+  out[0] = static_cast<char>('0' + value / 10);
+  out[1] = static_cast<char>('0' + value % 10);
+}
+
+}  // namespace
+
+char* FormatLogTime(char* out, time_t timestamp) {
+  static thread_local LogTimeCache cache;
+
+  if (!cache.valid || timestamp != cache.second) {
+    if (cache.valid && timestamp >= cache.minute &&
+        timestamp < cache.minute + 60) {
+      Put2(cache.text + 13, static_cast<int>(timestamp - cache.minute));
+    } else {
+      struct ::tm tm_time;
+      localtime_r(&timestamp, &tm_time);
+      FormatLogUint(cache.text, 1900 + tm_time.tm_year, 4);
+      Put2(cache.text + 4, 1 + tm_time.tm_mon);
+      Put2(cache.text + 6, tm_time.tm_mday);
+      cache.text[8] = '-';
+      Put2(cache.text + 9, tm_time.tm_hour);
+      Put2(cache.text + 11, tm_time.tm_min);
+      Put2(cache.text + 13, tm_time.tm_sec);
+      cache.minute = timestamp - tm_time.tm_sec;
+      cache.valid = true;
+    }
+    cache.second = timestamp;
+  }
 
-bool FileLogPolicy::DayHasChanged(time_t timestamp) {
+  memcpy(out, cache.text, sizeof(cache.text));
+  return out + sizeof(cache.text);
+}
+
+bool RollingLogPolicy::DayHasChanged(time_t timestamp) {
   int32_t days = (timestamp + 28800)/86400;
-  if (days != _kMainDay) {
-    _kMainDay = days;
+  if (days != _day) {
+    _day = days;
     return true;
   }
   return false;
 }
 
-bool FileLogPolicy::PidHasChanged() {
+bool RollingLogPolicy::PidHasChanged() {
   int32_t pid = getpid();
-  if (_kMainThreadPid == pid) {
+  if (_pid == pid) {
     return false;
   }
-  _kMainDay = pid;
+  _pid = pid;
   return true;
 }
 
-std::string FileLogPolicy::GetNameExtStr() const {
+bool RollingLogPolicy::NeedRollover(size_t size, time_t timestamp) {
+  _file_len += size;
+  bool day_changed = DayHasChanged(timestamp);
+  return _file_len >> 20 > _max_file_len || day_changed;
+}
+
+std::string RollingLogPolicy::GetNameExtStr() const {
   time_t timestamp = time(NULL);
   struct ::tm tm_time;
   localtime_r(&timestamp, &tm_time);
@@ -49,62 +121,369 @@ std::string FileLogPolicy::GetNameExtStr() const {
   return time_pid_stream.str();
 }
 
-void FileLogPolicy::OpenOstream(const std::string& name) {
+void FileLogPolicy::OpenOstream() {
   _file_len = 0;
-  _log_name_prefix = name;
-#if 0
-  std::string filename = name + GetNameExtStr();
-  _out_stream->open(filename.c_str(),
-      std::ios_base::binary | std::ios_base::out);
-  if (!_out_stream->is_open()) {
+  std::string filename;
+  // Never truncate: two rollovers in one second get the same name
+  _fd = OpenUniqueLogFile(NextFileName(), O_WRONLY, &filename);
+  if (_fd < 0) {
     throw(std::runtime_error("LOGGER:Unable to open an output stream"));
   }
-#endif
 }
 
-void FileLogPolicy::OpenOstream() {
-  _file_len = 0;
-  std::string filename = _log_name_prefix + GetNameExtStr();
-  _out_stream->open(filename.c_str(),
-      std::ios_base::binary | std::ios_base::out);
-  if (!_out_stream->is_open()) {
-    throw(std::runtime_error("LOGGER:Unable to open an output stream"));
+std::unique_lock<std::mutex> FileLogPolicy::Lock() {
+  if (_background && _background->pid != getpid()) {
+    // A forked child, the thread stayed in the parent
+    _background.release();
+  }
+  if (!_background) {
+    return std::unique_lock<std::mutex>();
+  }
+  return std::unique_lock<std::mutex>(_mutex);
+}
+
+void FileLogPolicy::CloseFile() {
+  if (_fd >= 0) {
+    WriteBuffer();
+    if (sync_none != _durability.sync) {
+      Sync(_fd);
+    }
+    close(_fd);
+    _fd = -1;
   }
 }
 
 void FileLogPolicy::CloseOstream() {
-  if (_out_stream) {
-    _out_stream->close();
+  std::unique_lock<std::mutex> guard = Lock();
+  CloseFile();
+}
+
+void FileLogPolicy::SetRotation(const LogRotateOptions& options) {
+  _rotator.reset(new LogRotator(NamePrefix(), O_WRONLY, options));
+}
+
+void FileLogPolicy::SetDurability(const LogDurability& durability) {
+  StopBackground();
+  _durability = durability;
+  if ((_durability.buffered && _durability.flush_ms > 0) ||
+      sync_none != _durability.sync) {
+    _background.reset(new Background());
+    _background->stop = false;
+    _background->pid = getpid();
+    _background->thread = std::thread(&FileLogPolicy::BackgroundLoop, this,
+        _background.get());
+  }
+}
+
+void FileLogPolicy::Reserve(size_t size, time_t timestamp) {
+  if (PidHasChanged()) {
+    if (_fd >= 0) {
+      // The parent still owns the file and whatever is buffered
+      _buffer.clear();
+      close(_fd);
+      _fd = -1;
+    }
+    // Its thread stayed in the parent, so it cannot even be joined
+    _rotator.release();
+  }
+  if (NeedRollover(size, timestamp) || _fd < 0) {
+    if (_rotator) {
+      WriteBuffer();
+      if (_fd >= 0 && sync_none != _durability.sync) {
+        Sync(_fd);
+      }
+      _fd = _rotator->Rotate(_fd, NextFileName());
+      if (_fd < 0) {
+        throw(std::runtime_error("LOGGER:Unable to open an output stream"));
+      }
+    } else {
+      CloseFile();
+      OpenOstream();
+    }
+    _file_len = size;
+    _buffer.append(FileHeader());
+  }
+}
+
+void FileLogPolicy::WriteFully(const struct iovec* iov, int count) {
+  std::vector<struct iovec> rest(iov, iov + count);
+  size_t done = 0;
+  while (done < rest.size()) {
+    int batch = static_cast<int>(std::min<size_t>(rest.size() - done, IOV_MAX));
+    ssize_t n = writev(_fd, &rest[done], batch);
+    if (n < 0) {
+      if (EINTR == errno) {
+        continue;
+      }
+      return;  // nowhere to report a failing log file
+    }
+    while (n > 0 && static_cast<size_t>(n) >= rest[done].iov_len) {
+      n -= rest[done].iov_len;
+      ++done;
+    }
+    if (n > 0) {
+      rest[done].iov_base = static_cast<char*>(rest[done].iov_base) + n;
+      rest[done].iov_len -= n;
+    }
+    while (done < rest.size() && 0 == rest[done].iov_len) {
+      ++done;
+    }
+  }
+}
+
+void FileLogPolicy::WriteBuffer() {
+  if (_buffer.empty() || _fd < 0) {
+    return;
+  }
+  struct iovec iov = { const_cast<char*>(_buffer.data()), _buffer.size() };
+  WriteFully(&iov, 1);
+  _buffer.clear();
+}
+
+void FileLogPolicy::Sync(int fd) {
+  if (sync_full == _durability.sync) {
+    fsync(fd);
+  } else {
+    fdatasync(fd);
   }
 }
 
 void FileLogPolicy::Write(const std::string& msg, time_t timestamp) {
-  _file_len += msg.length();
-  if (_file_len >> 20 > _max_file_len || DayHasChanged(timestamp) ||
-      PidHasChanged()) {
-    CloseOstream();
-    OpenOstream();
+  std::unique_lock<std::mutex> guard = Lock();
+  Reserve(msg.length() + 1, timestamp);
+  if (_durability.buffered) {
+    _buffer.append(msg);
+    _buffer.push_back('\n');
+    if (_buffer.size() >= _durability.flush_bytes) {
+      WriteBuffer();
+    }
+    return;
   }
-  (*_out_stream) << msg << std::endl;
-  // Write(msg.data(), msg.length(), timestamp);
+  // Text lines go out right away, as std::endl used to do
+  WriteBuffer();
+  struct iovec iov[2] = {
+    { const_cast<char*>(msg.data()), msg.length() },
+    { const_cast<char*>("\n"), 1 },
+  };
+  WriteFully(iov, 2);
 }
 
 void FileLogPolicy::Write(
     const char* data, size_t size, time_t timestamp) {
-  _file_len += size;
-  if (_file_len >> 20 > _max_file_len || DayHasChanged(timestamp) ||
-      PidHasChanged()) {
-    _out_stream->flush();
-    CloseOstream();
-    OpenOstream();
+  std::unique_lock<std::mutex> guard = Lock();
+  Reserve(size, timestamp);
+  _buffer.append(data, size);
+  if (_buffer.size() >= _durability.flush_bytes) {
+    WriteBuffer();
+  }
+}
+
+void FileLogPolicy::Write(
+    const struct iovec* iov, int count, time_t timestamp) {
+  std::unique_lock<std::mutex> guard = Lock();
+  size_t size = 0;
+  for (int i = 0; i < count; ++i) {
+    size += iov[i].iov_len;
   }
-  _out_stream->write(data, size);
+  Reserve(size, timestamp);
+  WriteBuffer();
+  WriteFully(iov, count);
+}
+
+void FileLogPolicy::Flush() {
+  std::unique_lock<std::mutex> guard = Lock();
+  if (!_durability.buffered || _buffer.size() >= _durability.flush_bytes) {
+    WriteBuffer();
+  }
+}
+
+void FileLogPolicy::ErrorWritten() {
+  if (!_durability.flush_errors) {
+    return;
+  }
+  std::unique_lock<std::mutex> guard = Lock();
+  WriteBuffer();
+  if (_fd >= 0 && sync_none != _durability.sync) {
+    Sync(_fd);
+  }
+}
+
+void FileLogPolicy::BackgroundLoop(Background* background) {
+  typedef std::chrono::steady_clock Clock;
+  bool flush = _durability.buffered && _durability.flush_ms > 0;
+  bool sync = sync_none != _durability.sync;
+  std::chrono::milliseconds flush_every(_durability.flush_ms);
+  std::chrono::milliseconds sync_every(_durability.sync_ms);
+  Clock::time_point next_flush = Clock::now() + flush_every;
+  Clock::time_point next_sync = Clock::now() + sync_every;
+
+  std::unique_lock<std::mutex> wait_guard(background->mutex);
+  while (!background->stop) {
+    Clock::time_point next = !flush ? next_sync :
+        !sync ? next_flush : std::min(next_flush, next_sync);
+    background->cv.wait_until(wait_guard, next);
+    if (background->stop) {
+      break;
+    }
+
+    Clock::time_point now = Clock::now();
+    if (flush && now >= next_flush) {
+      std::lock_guard<std::mutex> guard(_mutex);
+      WriteBuffer();
+      next_flush = now + flush_every;
+    }
+    if (sync && now >= next_sync) {
+      // Sync a duplicate outside the lock, writers go on meanwhile and
+      // a rotation may close _fd
+      int fd = -1;
+      {
+        std::lock_guard<std::mutex> guard(_mutex);
+        WriteBuffer();
+        fd = _fd >= 0 ? dup(_fd) : -1;
+      }
+      if (fd >= 0) {
+        Sync(fd);
+        close(fd);
+      }
+      next_sync = now + sync_every;
+    }
+  }
+}
+
+void FileLogPolicy::StopBackground() {
+  if (!_background) {
+    return;
+  }
+  if (_background->pid != getpid()) {
+    _background.release();
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> guard(_background->mutex);
+    _background->stop = true;
+  }
+  _background->cv.notify_one();
+  _background->thread.join();
+  _background.reset();
 }
 
 FileLogPolicy::~FileLogPolicy() {
-  if (_out_stream) {
+  StopBackground();
+  CloseFile();
+}
+
+void MmapFileLogPolicy::OpenOstream() {
+  _file_len = 0;
+  std::string filename;
+  _fd = OpenUniqueLogFile(NextFileName(), O_RDWR, &filename);
+  if (_fd < 0) {
+    throw(std::runtime_error("LOGGER:Unable to open an output stream"));
+  }
+  _offset.store(0, std::memory_order_relaxed);
+  MapChunk(0);
+}
+
+void MmapFileLogPolicy::Unmap() {
+  if (_map) {
+    munmap(_map, kMapBytes);
+    _map = nullptr;
+  }
+}
+
+void MmapFileLogPolicy::CloseOstream() {
+  if (_fd >= 0) {
+    Unmap();
+    if (0 != ftruncate(_fd, _offset.load(std::memory_order_relaxed))) {
+      // keep the zero tail, readers stop at it
+    }
+    close(_fd);
+    _fd = -1;
+  }
+}
+
+void MmapFileLogPolicy::MapChunk(size_t offset) {
+  Unmap();
+  if (0 != ftruncate(_fd, offset + kMapBytes)) {
+    throw(std::runtime_error("LOGGER:Unable to extend the log file"));
+  }
+  // Allocate the blocks now: a full disk fails here, not as a SIGBUS in
+  // the middle of a memcpy. Some file systems cannot, they are still fine.
+  int err = posix_fallocate(_fd, offset, kMapBytes);
+  if (0 != err && EOPNOTSUPP != err && EINVAL != err) {
+    throw(std::runtime_error("LOGGER:Unable to allocate the log file"));
+  }
+  void* addr = mmap(nullptr, kMapBytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+      _fd, offset);
+  if (MAP_FAILED == addr) {
+    throw(std::runtime_error("LOGGER:Unable to map the log file"));
+  }
+  _map = static_cast<char*>(addr);
+  _map_offset = offset;
+}
+
+void MmapFileLogPolicy::Reserve(size_t size, time_t timestamp) {
+  if (PidHasChanged() && _fd >= 0) {
+    // Shared with the parent: no trimming, the parent is still writing
+    Unmap();
+    close(_fd);
+    _fd = -1;
+  }
+  if (NeedRollover(size, timestamp) || _fd < 0) {
     CloseOstream();
+    OpenOstream();
+    _file_len = size;
+    std::string header = FileHeader();
+    Append(header.data(), header.size());
+  }
+}
+
+void MmapFileLogPolicy::Append(const char* data, size_t size) {
+  size_t pos = _offset.fetch_add(size, std::memory_order_relaxed);
+  while (size > 0) {
+    if (pos >= _map_offset + kMapBytes) {
+      MapChunk(pos - pos % kMapBytes);
+    }
+    size_t room = _map_offset + kMapBytes - pos;
+    size_t n = size < room ? size : room;
+    memcpy(_map + (pos - _map_offset), data, n);
+    pos += n;
+    data += n;
+    size -= n;
+  }
+}
+
+void MmapFileLogPolicy::Write(const std::string& msg, time_t timestamp) {
+  Reserve(msg.length() + 1, timestamp);
+  Append(msg.data(), msg.length());
+  Append("\n", 1);
+}
+
+void MmapFileLogPolicy::Write(
+    const char* data, size_t size, time_t timestamp) {
+  Reserve(size, timestamp);
+  Append(data, size);
+}
+
+void MmapFileLogPolicy::Write(
+    const struct iovec* iov, int count, time_t timestamp) {
+  size_t size = 0;
+  for (int i = 0; i < count; ++i) {
+    size += iov[i].iov_len;
   }
+  Reserve(size, timestamp);
+  for (int i = 0; i < count; ++i) {
+    Append(static_cast<const char*>(iov[i].iov_base), iov[i].iov_len);
+  }
+}
+
+void MmapFileLogPolicy::Flush() {
+  if (_map) {
+    msync(_map, kMapBytes, MS_ASYNC);
+  }
+}
+
+MmapFileLogPolicy::~MmapFileLogPolicy() {
+  CloseOstream();
 }
 
 }  // namespace utils
@@ -5,6 +5,7 @@
 #define SRC_UTILS_LOGGING_H_
 #include<time.h>
 #include<unistd.h>
+#include<sys/uio.h>
 
 #include<string>
 #include<mutex>
@@ -14,9 +15,25 @@
 #include<iostream>
 #include<iomanip>
 #include<atomic>
+#include<chrono>
+#include<condition_variable>
+#include<functional>
+#include<thread>
+#include<unordered_set>
+#include<utility>
+#include<vector>
+
+#include "log_binary.h"
+#include "log_limit.h"
+#include "log_ring.h"
+#include "log_rotator.h"
 
 // @Author dongyue.zhang(zhangdy1986(at)gmail.com)
-// @Brief Log print, thread safe, TODO: (zdy)no buffering
+// @Brief Log print, thread safe. By default every line is written under
+//        _write_mutex on the caller's thread, after StartAsync callers
+//        only format and enqueue and a flush thread batches the writes.
+//        StartBuffered gives every thread its own buffer instead, full
+//        or aged buffers go out together in one writev.
 
 namespace utils {
 enum  SeverityType{
@@ -26,6 +43,102 @@ enum  SeverityType{
   binary,
 };
 
+// Lowest severity compiled in, 0 debug, 1 warning, 2 error. Below it the
+// UTILS_LOG macros compile to nothing, arguments included.
+#ifndef UTILS_LOG_MIN_LEVEL
+#define UTILS_LOG_MIN_LEVEL 0
+#endif
+
+/* Importance of a severity, the enum values are not in that order.
+ * binary is never filtered. */
+constexpr int SeverityRank(SeverityType severity) {
+  return SeverityType::binary == severity ? 3 :
+         SeverityType::error == severity ? 2 :
+         SeverityType::warning == severity ? 1 : 0;
+}
+
+constexpr const char* SeverityTag(SeverityType severity) {
+  return SeverityType::debug == severity ? "[DEBUG]\t" :
+         SeverityType::error == severity ? "[ERROR]\t" :
+         SeverityType::warning == severity ? "[WARNING]\t" : "";
+}
+
+/* Print when severity is enabled, both checks run before any argument is
+ * evaluated: a filtered call is one load and one branch, or nothing at
+ * all below UTILS_LOG_MIN_LEVEL */
+#define UTILS_LOG(logger, severity, ...) do { \
+    if ((logger).template Enabled<severity>()) { \
+      (logger).template Print<severity>(__VA_ARGS__); \
+    } \
+  } while (0)
+
+/* UTILS_LOG under a per call site LogLimiter: at most per_second calls
+ * a second (0 for no limit) and only one call in one_in (0 or 1 for all)
+ * are printed. Sampling is silent. Calls over the rate limit are
+ * counted in a "suppressed N messages" line, at most one a second per
+ * site, see LogLimiter::Allow. */
+#define UTILS_LOG_LIMITED(logger, severity, per_second, one_in, ...) do { \
+    if ((logger).template Enabled<severity>()) { \
+      static ::utils::LogLimiter log_limiter(per_second, one_in); \
+      uint64_t log_suppressed = 0; \
+      bool log_allowed = log_limiter.Allow(time(NULL), &log_suppressed); \
+      if (log_suppressed > 0) { \
+        (logger).template Print<severity>("suppressed ", log_suppressed, \
+            " messages at " __FILE__ ":", __LINE__); \
+      } \
+      if (log_allowed) { \
+        (logger).template Print<severity>(__VA_ARGS__); \
+      } \
+    } \
+  } while (0)
+
+/* Zero padded to at least width digits
+ * @return end of the written digits */
+char* FormatLogUint(char* out, uint64_t value, int width);
+
+/* Local time as "YYYYmmdd-HHMMSS", 15 chars. localtime_r runs once per
+ * minute and thread, other seconds only patch the last two digits.
+ * @return end of the written chars */
+char* FormatLogTime(char* out, time_t timestamp);
+
+/* streambuf appending to a string, so a formatted line is used in place
+ * instead of copied out like ostringstream::str() does */
+class LogStringBuf : public std::streambuf {
+ public:
+    explicit LogStringBuf(std::string* out) : _out(out) {}
+
+ protected:
+    int_type overflow(int_type c) {
+      if (!traits_type::eq_int_type(c, traits_type::eof())) {
+        _out->push_back(traits_type::to_char_type(c));
+      }
+      return traits_type::not_eof(c);
+    }
+
+    std::streamsize xsputn(const char* data, std::streamsize size) {
+      _out->append(data, size);
+      return size;
+    }
+
+ private:
+    std::string* _out;
+};
+
+struct LogLineWriter {
+  LogLineWriter() : buf(&line), stream(&buf) {}
+
+  std::string line;
+  LogStringBuf buf;
+  std::ostream stream;
+};
+
+/* What an async Print does when the ring is full */
+enum OverflowType {
+  overflow_block = 1,  // wait for the flush thread to make room
+  overflow_drop,       // discard the record, see Logger::Dropped
+  overflow_count,      // discard, and log how many were lost
+};
+
 template<typename TLogPolicy>
 class Logger {
  public:
@@ -37,26 +150,166 @@ class Logger {
 
     void PrintBinary(const char* data, size_t len);
 
+    /* Deferred formatting: writes the site frame once, then per call the
+     * site id, time and raw argument bytes (see log_binary.h). Every
+     * file the policy opens later starts with the frames of all sites
+     * seen so far, so each file decodes on its own. The stream is
+     * binary, give it a Logger of its own and turn it back into text
+     * with log_decoder.
+     * */
+    template<typename...Args>
+    void PrintDeferred(LogSite& site, Args&&...args);
+
     void SetMaxFileLen(int32_t len);
 
+    /* Policy specific settings, e.g. FileLogPolicy::SetRotation. Not
+     * synchronized, configure before logging starts. */
+    TLogPolicy* GetPolicy() {
+      return _policy;
+    }
+
+    /* Runtime minimum severity, on top of UTILS_LOG_MIN_LEVEL */
+    void SetMinLevel(SeverityType severity) {
+      _min_rank.store(SeverityRank(severity), std::memory_order_relaxed);
+    }
+
+    template<SeverityType severity>
+    bool Enabled() const {
+      return SeverityRank(severity) >= UTILS_LOG_MIN_LEVEL &&
+        SeverityRank(severity) >= _min_rank.load(std::memory_order_relaxed);
+    }
+
+    /* Switch to asynchronous output. Call once, before other threads
+     * start logging.
+     * @params[in] ring_size : records buffered before overflow kicks in
+     * */
+    void StartAsync(size_t ring_size = 8192,
+                    OverflowType overflow = overflow_block);
+
+    /* Switch to per-thread buffering. Each thread appends to a private
+     * buffer, the flush thread writes the full ones, and the ones holding
+     * lines older than max_age_ms, with a single writev. Lines stay in
+     * order per thread, not across threads. Call once, before other
+     * threads start logging, instead of StartAsync.
+     * */
+    void StartBuffered(size_t buffer_bytes = 64 * 1024,
+                       int max_age_ms = 100);
+
+    /* Records lost to a full ring in async mode */
+    uint64_t Dropped() const {
+      return _dropped.load(std::memory_order_relaxed);
+    }
+
  private:
-    std::string GetTime();
-    std::string GetLogingHeader();
+    static const size_t kBatchBytes = 64 * 1024;
+    static const size_t kHeaderBytes = 64;
+    enum { kFlushIntervalMs = 10 };
+
+    /* Writes "line\t[YYYYmmdd-HHMMSS-clock]\t", at most kHeaderBytes
+     * @return bytes written */
+    size_t GetLogingHeader(char* out, time_t timestamp);
     void PrintImpl();
 
     template<typename TFirst, typename...TRest>
     void PrintImpl(TFirst first, TRest...rest);
 
+    static void Format(std::ostream& /*stream*/) {}
+
+    template<typename TFirst, typename...TRest>
+    static void Format(std::ostream& stream, TFirst first, TRest...rest) {
+      stream << first;
+      Format(stream, rest...);
+    }
+
+    /* Header, severity, args and newline in the calling thread's line
+     * buffer, valid until its next call */
+    template<SeverityType severity, typename...Args>
+    const std::string& FormatRecord(time_t timestamp, Args...args);
+
+    template<SeverityType severity, typename...Args>
+    void PrintAsync(Args...args);
+
+    /* PrintBinary with the time already taken */
+    void WriteBinary(const char* data, size_t len, time_t timestamp);
+
+    void Enqueue(const char* data, size_t len, time_t timestamp);
+    bool DrainRing(std::string* batch, uint64_t* reported);
+    void FlushLoop();
+    void StopAsync();
+
+    struct ThreadBuffer {
+      std::mutex lock;
+      std::string data;
+      time_t timestamp;  // of the newest line
+      std::chrono::steady_clock::time_point since;  // of the oldest line
+    };
+
+    /* A buffer taken off its thread, waiting for the writev */
+    struct FullBuffer {
+      std::string data;
+      time_t timestamp;
+    };
+
+    static uint64_t NextId() {
+      static std::atomic<uint64_t> next_id(0);
+      return ++next_id;
+    }
+
+    /* The calling thread's buffer, registered on first use */
+    ThreadBuffer* LocalBuffer();
+
+    template<SeverityType severity, typename...Args>
+    void PrintBuffered(Args...args);
+
+    void Append(const char* data, size_t len, time_t timestamp);
+
+    /* Caller holds buffer->lock */
+    void HandOff(ThreadBuffer* buffer);
+
+    bool DrainBuffers(bool all);
+
+    /* Policy callback, the site frames a new file starts with */
+    void AppendSiteFrames(std::string* out);
+
  private:
     std::atomic<unsigned> _log_ling_number;
+    std::atomic<int> _min_rank;
     TLogPolicy* _policy;
     std::mutex _write_mutex;
     std::stringstream _log_stream;
     time_t _timestamp;
+
+    std::unique_ptr<LogRing> _ring;
+    OverflowType _overflow;
+    std::atomic<uint64_t> _dropped;
+    std::atomic<bool> _stop;
+    std::mutex _wake_mutex;
+    std::condition_variable _wake_cv;
+    std::condition_variable _room_cv;  // producers blocked on a full ring
+    std::atomic<int> _blocked;
+    std::atomic<bool> _half_woken;  // since the last drain
+    std::thread _flusher;
+
+    uint64_t _id;
+    size_t _buffer_bytes;
+    std::chrono::milliseconds _max_age;
+    bool _buffered;
+    std::mutex _buffers_mutex;
+    std::vector<std::shared_ptr<ThreadBuffer> > _buffers;
+    std::mutex _handoff_mutex;
+    std::vector<FullBuffer> _full;
+    std::vector<std::string> _spare;
+
+    std::mutex _sites_mutex;
+    std::unordered_set<uint32_t> _site_ids;  // in _site_frames
+    std::string _site_frames;
 };
 
 template<typename TLogPolicy>
-Logger<TLogPolicy>::Logger(const std::string& name) {
+Logger<TLogPolicy>::Logger(const std::string& name)
+    : _min_rank(0), _overflow(overflow_block), _dropped(0), _stop(false),
+      _blocked(0), _half_woken(false), _id(NextId()),
+      _buffer_bytes(0), _max_age(0), _buffered(false) {
   _timestamp = time(NULL);
   _log_ling_number = 0;
   _policy = new(std::nothrow) TLogPolicy();
@@ -64,10 +317,13 @@ Logger<TLogPolicy>::Logger(const std::string& name) {
     throw std::runtime_error("LOGGER:Unable to create the logger instance");
   }
   _policy->OpenOstream(name);
+  _policy->SetFileHeader(
+      std::bind(&Logger::AppendSiteFrames, this, std::placeholders::_1));
 }
 
 template<typename TLogPolicy>
 Logger<TLogPolicy>::~Logger() noexcept {
+  StopAsync();
   if (_policy) {
     _policy->CloseOstream();
     delete _policy;
@@ -79,80 +335,393 @@ void Logger<TLogPolicy>::SetMaxFileLen(int32_t len) {
   _policy->SetMaxFileLen(len);
 }
 
+template<typename TLogPolicy>
+void Logger<TLogPolicy>::StartAsync(size_t ring_size,
+                                    OverflowType overflow) {
+  if (_flusher.joinable()) {
+    return;
+  }
+  _overflow = overflow;
+  _ring.reset(new LogRing(ring_size));
+  _flusher = std::thread(&Logger::FlushLoop, this);
+}
+
+template<typename TLogPolicy>
+void Logger<TLogPolicy>::StartBuffered(size_t buffer_bytes,
+                                       int max_age_ms) {
+  if (_flusher.joinable()) {
+    return;
+  }
+  _buffer_bytes = buffer_bytes;
+  _max_age = std::chrono::milliseconds(max_age_ms);
+  _buffered = true;
+  _flusher = std::thread(&Logger::FlushLoop, this);
+}
+
+template<typename TLogPolicy>
+void Logger<TLogPolicy>::StopAsync() {
+  if (!_flusher.joinable()) {
+    return;
+  }
+  _stop.store(true, std::memory_order_release);
+  _wake_cv.notify_one();
+  _flusher.join();
+}
+
 template<typename TLogPolicy>
 template<SeverityType severity, typename...Args>
 void Logger<TLogPolicy>::Print(Args...args) {
-  // TODO(dongyue): Mutex is slower,add buffering or shared mem
-  _write_mutex.lock();
-  switch (severity) {
-    case SeverityType::debug:
-      _log_stream << "[DEBUG]\t";
-      break;
-    case SeverityType::error:
-      _log_stream << "[ERROR]\t";
-      break;
-    case SeverityType::warning:
-      _log_stream << "[WARNING]\t";
+  if (!Enabled<severity>()) {
+    return;
+  }
+  if (_ring) {
+    PrintAsync<severity>(args...);
+    return;
   }
+  if (_buffered) {
+    PrintBuffered<severity>(args...);
+    return;
+  }
+  _write_mutex.lock();
+  _log_stream << SeverityTag(severity);
   PrintImpl(args...);
+  if (SeverityType::error == severity) {
+    _policy->ErrorWritten();
+  }
   _write_mutex.unlock();
 }
 
+template<typename TLogPolicy>
+template<SeverityType severity, typename...Args>
+const std::string& Logger<TLogPolicy>::FormatRecord(time_t timestamp,
+                                                    Args...args) {
+  static thread_local LogLineWriter writer;
+  char header[kHeaderBytes];
+
+  writer.line.assign(header, GetLogingHeader(header, timestamp));
+  writer.line.append(SeverityTag(severity));
+  Format(writer.stream, args...);
+  writer.line.push_back('\n');
+  return writer.line;
+}
+
+template<typename TLogPolicy>
+template<SeverityType severity, typename...Args>
+void Logger<TLogPolicy>::PrintAsync(Args...args) {
+  time_t timestamp = time(NULL);
+  const std::string& record = FormatRecord<severity>(timestamp, args...);
+  Enqueue(record.data(), record.size(), timestamp);
+}
+
+template<typename TLogPolicy>
+void Logger<TLogPolicy>::Enqueue(
+    const char* data, size_t len, time_t timestamp) {
+  while (!_ring->TryPush(data, len, timestamp)) {
+    if (overflow_block != _overflow) {
+      _dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    // Sleep until the flush thread has drained, it notifies _room_cv
+    // under _wake_mutex, so the check below cannot miss it
+    _blocked.fetch_add(1);
+    {
+      std::unique_lock<std::mutex> guard(_wake_mutex);
+      _wake_cv.notify_one();
+      _room_cv.wait_for(guard, std::chrono::milliseconds(kFlushIntervalMs),
+          [this] { return _ring->Size() < _ring->Capacity(); });
+    }
+    _blocked.fetch_sub(1);
+  }
+  // Wake the flush thread early once the ring is half full, producers
+  // racing past the mark wake it once
+  if (_ring->Size() >= _ring->Capacity() / 2 &&
+      !_half_woken.load(std::memory_order_relaxed) &&
+      !_half_woken.exchange(true)) {
+    _wake_cv.notify_one();
+  }
+}
+
+template<typename TLogPolicy>
+bool Logger<TLogPolicy>::DrainRing(std::string* batch, uint64_t* reported) {
+  time_t batch_time = 0;
+  time_t timestamp = 0;
+  bool wrote = false;
+  size_t before = 0;
+
+  // One policy Write per batch, split where the second changes so the
+  // policy still sees the right time for its day rollover
+  while (_ring->TryPop(batch, &timestamp)) {
+    if (before > 0 && timestamp != batch_time) {
+      _policy->Write(batch->data(), before, batch_time);
+      batch->erase(0, before);
+    }
+    batch_time = timestamp;
+    before = batch->size();
+    if (before >= kBatchBytes) {
+      _policy->Write(batch->data(), before, batch_time);
+      batch->clear();
+      before = 0;
+      wrote = true;
+    }
+  }
+  if (!batch->empty()) {
+    _policy->Write(batch->data(), batch->size(), batch_time);
+    batch->clear();
+    wrote = true;
+  }
+
+  uint64_t dropped = _dropped.load(std::memory_order_relaxed);
+  if (overflow_count == _overflow && dropped != *reported) {
+    timestamp = time(NULL);
+    const std::string& line = FormatRecord<SeverityType::warning>(
+        timestamp, "LOGGER:ring full, dropped ", dropped - *reported,
+        " records");
+    _policy->Write(line.data(), line.size(), timestamp);
+    *reported = dropped;
+    wrote = true;
+  }
+  return wrote;
+}
+
+template<typename TLogPolicy>
+void Logger<TLogPolicy>::FlushLoop() {
+  std::string batch;
+  batch.reserve(kBatchBytes);
+  uint64_t reported = 0;
+
+  while (true) {
+    bool stop = _stop.load(std::memory_order_acquire);
+    bool wrote = _ring ? DrainRing(&batch, &reported) : DrainBuffers(stop);
+    if (_ring) {
+      _half_woken.store(false);
+      if (_blocked.load() > 0) {
+        std::lock_guard<std::mutex> guard(_wake_mutex);
+        _room_cv.notify_all();
+      }
+    }
+    if (wrote) {
+      _policy->Flush();
+    }
+    if (stop) {
+      break;
+    }
+    // A wake up sent while draining is not lost, a ring already half
+    // full again is drained right away
+    std::unique_lock<std::mutex> guard(_wake_mutex);
+    _wake_cv.wait_for(guard, std::chrono::milliseconds(kFlushIntervalMs),
+        [this] { return _stop.load(std::memory_order_acquire) ||
+                 (_ring && _ring->Size() >= _ring->Capacity() / 2); });
+  }
+}
+
+template<typename TLogPolicy>
+typename Logger<TLogPolicy>::ThreadBuffer* Logger<TLogPolicy>::LocalBuffer() {
+  // Keyed by logger id, not address, a new logger may reuse the address
+  static thread_local
+    std::vector<std::pair<uint64_t, std::shared_ptr<ThreadBuffer> > > local;
+  for (size_t i = 0; i < local.size(); ++i) {
+    if (local[i].first == _id) {
+      return local[i].second.get();
+    }
+  }
+
+  std::shared_ptr<ThreadBuffer> buffer = std::make_shared<ThreadBuffer>();
+  buffer->data.reserve(_buffer_bytes);
+  {
+    std::lock_guard<std::mutex> guard(_buffers_mutex);
+    _buffers.push_back(buffer);
+  }
+  local.push_back(std::make_pair(_id, buffer));
+  return buffer.get();
+}
+
+template<typename TLogPolicy>
+template<SeverityType severity, typename...Args>
+void Logger<TLogPolicy>::PrintBuffered(Args...args) {
+  time_t timestamp = time(NULL);
+  const std::string& record = FormatRecord<severity>(timestamp, args...);
+  Append(record.data(), record.size(), timestamp);
+}
+
+template<typename TLogPolicy>
+void Logger<TLogPolicy>::Append(
+    const char* data, size_t len, time_t timestamp) {
+  ThreadBuffer* buffer = LocalBuffer();
+  std::lock_guard<std::mutex> guard(buffer->lock);
+  if (buffer->data.empty()) {
+    buffer->since = std::chrono::steady_clock::now();
+  }
+  buffer->data.append(data, len);
+  buffer->timestamp = timestamp;
+  if (buffer->data.size() >= _buffer_bytes) {
+    HandOff(buffer);
+  }
+}
+
+template<typename TLogPolicy>
+void Logger<TLogPolicy>::HandOff(ThreadBuffer* buffer) {
+  FullBuffer full;
+  full.data.swap(buffer->data);
+  full.timestamp = buffer->timestamp;
+
+  std::lock_guard<std::mutex> guard(_handoff_mutex);
+  _full.push_back(std::move(full));
+  if (!_spare.empty()) {
+    buffer->data.swap(_spare.back());
+    _spare.pop_back();
+  }
+  _wake_cv.notify_one();
+}
+
+template<typename TLogPolicy>
+bool Logger<TLogPolicy>::DrainBuffers(bool all) {
+  std::vector<FullBuffer> batch;
+  {
+    std::lock_guard<std::mutex> guard(_handoff_mutex);
+    batch.swap(_full);
+  }
+
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  {
+    std::lock_guard<std::mutex> guard(_buffers_mutex);
+    for (size_t i = 0; i < _buffers.size(); ) {
+      ThreadBuffer* buffer = _buffers[i].get();
+      {
+        std::lock_guard<std::mutex> buffer_guard(buffer->lock);
+        if (!buffer->data.empty() && (all || now - buffer->since >= _max_age)) {
+          FullBuffer aged;
+          aged.data.swap(buffer->data);
+          aged.timestamp = buffer->timestamp;
+          batch.push_back(std::move(aged));
+        }
+      }
+      // Only the registry holds it: the thread has exited, and it is empty
+      if (_buffers[i].use_count() == 1 && buffer->data.empty()) {
+        _buffers[i] = _buffers.back();
+        _buffers.pop_back();
+      } else {
+        ++i;
+      }
+    }
+  }
+
+  if (batch.empty()) {
+    return false;
+  }
+
+  std::vector<struct iovec> iov(batch.size());
+  time_t timestamp = 0;
+  for (size_t i = 0; i < batch.size(); ++i) {
+    iov[i].iov_base = const_cast<char*>(batch[i].data.data());
+    iov[i].iov_len = batch[i].data.size();
+    if (batch[i].timestamp > timestamp) {
+      timestamp = batch[i].timestamp;
+    }
+  }
+  _policy->Write(iov.data(), static_cast<int>(iov.size()), timestamp);
+
+  std::lock_guard<std::mutex> guard(_handoff_mutex);
+  for (size_t i = 0; i < batch.size() && _spare.size() < 64; ++i) {
+    batch[i].data.clear();
+    _spare.push_back(std::move(batch[i].data));
+  }
+  return true;
+}
+
 template<typename TLogPolicy>
 void Logger<TLogPolicy>::PrintBinary(
     const char* data, size_t len) {
+  WriteBinary(data, len, time(NULL));
+}
+
+template<typename TLogPolicy>
+void Logger<TLogPolicy>::WriteBinary(
+    const char* data, size_t len, time_t timestamp) {
+  if (_ring) {
+    Enqueue(data, len, timestamp);
+    return;
+  }
+  if (_buffered) {
+    Append(data, len, timestamp);
+    return;
+  }
   _write_mutex.lock();
-  _timestamp = time(NULL);
+  _timestamp = timestamp;
   _policy->Write(data, len, _timestamp);
   _write_mutex.unlock();
 }
 
 template<typename TLogPolicy>
-std::string Logger<TLogPolicy>::GetTime() {
-#if 0
-  std::string time_str;
-  time_t raw_time;
-
-  time(&raw_time);
-  time_str = ctime_r(&raw_time);
-  return time_str.substr(0, time_str.size() - 1);
-#endif
-  _timestamp = time(NULL);
-  struct ::tm tm_time;
-  localtime_r(&_timestamp, &tm_time);
+template<typename...Args>
+void Logger<TLogPolicy>::PrintDeferred(LogSite& site, Args&&...args) {
+  if (SeverityRank(static_cast<SeverityType>(site.severity)) <
+      _min_rank.load(std::memory_order_relaxed)) {
+    return;
+  }
+  static thread_local std::string frames;
+  static thread_local std::string payload;
+  time_t timestamp = time(NULL);
+  uint32_t id = site.Id();
+
+  frames.clear();
+  // Site and record go out in one write, so the site is in the record's
+  // file. Registered before defined_for is set: a record written
+  // without its site frame goes to a file whose header has it.
+  if (site.defined_for.load(std::memory_order_acquire) != _id) {
+    payload.clear();
+    AppendLogVarint(&payload, id);
+    AppendLogVarint(&payload, site.severity);
+    AppendLogVarint(&payload, site.line);
+    AppendLogString(&payload, site.file, strlen(site.file));
+    AppendLogVarint(&payload, sizeof...(args));
+    DescribeLogArgs(&payload, std::forward<Args>(args)...);
+    AppendLogFrame(&frames, kLogSiteFrame, payload);
+    {
+      std::lock_guard<std::mutex> guard(_sites_mutex);
+      if (_site_ids.insert(id).second) {
+        _site_frames.append(frames);
+      }
+    }
+    site.defined_for.store(_id, std::memory_order_release);
+  }
 
-  std::ostringstream time_stream;
-  time_stream.fill('0');
-  time_stream << 1900+tm_time.tm_year
-    << std::setw(2) << 1+tm_time.tm_mon
-    << std::setw(2) << tm_time.tm_mday
-    << '-'
-    << std::setw(2) << tm_time.tm_hour
-    << std::setw(2) << tm_time.tm_min
-    << std::setw(2) << tm_time.tm_sec;
+  payload.clear();
+  AppendLogVarint(&payload, id);
+  AppendLogVarint(&payload, timestamp);
+  EncodeLogArgs(&payload, std::forward<Args>(args)...);
+  AppendLogFrame(&frames, kLogRecordFrame, payload);
 
-  return time_stream.str();
+  WriteBinary(frames.data(), frames.size(), timestamp);
 }
 
 template<typename TLogPolicy>
-std::string Logger<TLogPolicy>::GetLogingHeader() {
-  std::stringstream header;
-
-  header.str("");
-  header.fill('0');
-  header.width(7);
-  header << _log_ling_number++ << "\t[" << GetTime() << "-";
-
-  header.fill('0');
-  header.width(7);
-  header << clock() << "]\t";
+void Logger<TLogPolicy>::AppendSiteFrames(std::string* out) {
+  std::lock_guard<std::mutex> guard(_sites_mutex);
+  out->append(_site_frames);
+}
 
-  return header.str();
+template<typename TLogPolicy>
+size_t Logger<TLogPolicy>::GetLogingHeader(char* out, time_t timestamp) {
+  char* pos = out;
+  pos = FormatLogUint(pos, _log_ling_number++, 7);
+  *pos++ = '\t';
+  *pos++ = '[';
+  pos = FormatLogTime(pos, timestamp);
+  *pos++ = '-';
+  clock_t ticks = clock();
+  pos = FormatLogUint(pos, ticks > 0 ? ticks : 0, 7);
+  *pos++ = ']';
+  *pos++ = '\t';
+  return pos - out;
 }
 
 template<typename TLogPolicy>
 void Logger<TLogPolicy>::PrintImpl() {
-  _policy->Write(GetLogingHeader() + _log_stream.str(), _timestamp);
+  char header[kHeaderBytes];
+  _timestamp = time(NULL);
+  std::string line(header, GetLogingHeader(header, _timestamp));
+  line.append(_log_stream.str());
+  _policy->Write(line, _timestamp);
   _log_stream.str("");
 }
 
@@ -172,45 +741,218 @@ class LogPolicyInterface {
         time_t timestamp) = 0;
     virtual void Write(const char* data,
         size_t size, time_t timestamp) = 0;
+    /* Gathered write of count buffers, in order */
+    virtual void Write(const struct iovec* iov,
+        int count, time_t timestamp) = 0;
+    virtual void Flush() = 0;
+    /* An error line just went through Write, on the caller's thread.
+     * Lines of async loggers reach the policy on the flush thread, as
+     * plain writes. */
+    virtual void ErrorWritten() {}
+
+    /* header(&bytes) is asked for the bytes every new file starts with,
+     * on the thread that opens it, with the policy's locks held */
+    virtual void SetFileHeader(
+        std::function<void(std::string*)> /*header*/) {}
 
     virtual void SetMaxFileLen(int32_t len) = 0;
 };
 
-class FileLogPolicy : public LogPolicyInterface {
+/* File naming and rollover rules shared by the file policies: a new
+ * file "<prefix>YYYYmmdd-HHMMSS.<pid>" once _max_file_len MB are written,
+ * at the start of a day, and in a forked child */
+class RollingLogPolicy : public LogPolicyInterface {
  public:
-    FileLogPolicy():
-      _out_stream(new std::ofstream),
+    RollingLogPolicy():
+      _file_len(0),
+      _log_name_prefix(""),
       _max_file_len(1800),
-      _log_name_prefix("") {}
-
-    void OpenOstream(const std::string& name);
-    void CloseOstream();
-
-    void Write(const std::string& msg, time_t timestamp);
-    void Write(const char* data, size_t size, time_t timestamp);
+      _pid(getpid()),
+      _day(-1) {}
 
-    virtual ~FileLogPolicy();
+    void OpenOstream(const std::string& name) {
+      _file_len = 0;
+      _log_name_prefix = name;
+    }
 
     void SetMaxFileLen(int32_t len) {
       _max_file_len = len;
     }
 
+    void SetFileHeader(std::function<void(std::string*)> header) {
+      _file_header = header;
+    }
+
+ protected:
+    /* Count size more bytes
+     * @return true if they have to go to a new file */
+    bool NeedRollover(size_t size, time_t timestamp);
+
+    /* @return true once in a forked child, which must drop the parent's
+     * file without flushing or trimming it */
+    bool PidHasChanged();
+
+    std::string NextFileName() const {
+      return _log_name_prefix + GetNameExtStr();
+    }
+
+    const std::string& NamePrefix() const {
+      return _log_name_prefix;
+    }
+
+    /* The bytes a new file starts with, counted in _file_len */
+    std::string FileHeader() {
+      std::string header;
+      if (_file_header) {
+        _file_header(&header);
+      }
+      _file_len += header.size();
+      return header;
+    }
+
+    int64_t _file_len; /*Bytes*/
+
  private:
-    void OpenOstream();
     bool DayHasChanged(time_t timestamp);
-    bool PidHasChanged();
     int32_t GetMainThreadPid() const {
-      return _kMainThreadPid;
+      return _pid;
     }
     std::string GetNameExtStr() const;
 
  private:
-    std::unique_ptr<std::ofstream> _out_stream;
     std::string _log_name_prefix;
-    int32_t _file_len; /*Bytes*/
     int32_t _max_file_len; /*MBytes*/
-    static int32_t _kMainThreadPid;
-    static int32_t _kMainDay;
+    int32_t _pid;
+    int32_t _day;
+    std::function<void(std::string*)> _file_header;
+};
+
+enum LogSyncType {
+  sync_none = 0,
+  sync_data,  // fdatasync
+  sync_full,  // fsync
+};
+
+/* How FileLogPolicy trades latency for durability. The default writes
+ * every text line at once and never syncs. Buffered with small
+ * flush_ms / flush_bytes is group commit: lines of all threads go out
+ * together, at most flush_ms late. */
+struct LogDurability {
+  LogDurability()
+    : buffered(false), flush_bytes(64 * 1024), flush_ms(1000),
+      sync(sync_none), sync_ms(1000), flush_errors(true) {}
+
+  bool buffered;       // keep text lines in memory, like binary ones
+  size_t flush_bytes;  // write once this much is pending
+  int flush_ms;        // buffered: and at least this often, 0 by size only
+  LogSyncType sync;    // push written data to disk every sync_ms
+  int sync_ms;
+  bool flush_errors;   // write, and sync if sync is set, error lines at once
+};
+
+class FileLogPolicy : public RollingLogPolicy {
+ public:
+    FileLogPolicy(): _fd(-1) {}
+
+    using RollingLogPolicy::OpenOstream;
+
+    void CloseOstream();
+
+    void Write(const std::string& msg, time_t timestamp);
+    void Write(const char* data, size_t size, time_t timestamp);
+    void Write(const struct iovec* iov, int count, time_t timestamp);
+
+    /* End of a batch: pending data is written, except in buffered mode
+     * where flush_bytes and flush_ms decide */
+    void Flush();
+    void ErrorWritten();
+
+    /* Timed flushes and syncs run on a thread of the policy, which then
+     * serializes all calls with a mutex of its own. Call after
+     * OpenOstream, before logging starts. */
+    void SetDurability(const LogDurability& durability);
+
+    /* Rotate in the background: the next file is opened ahead of time,
+     * the finished one closed, compressed and expired by a LogRotator
+     * thread. Call after OpenOstream, before logging starts. */
+    void SetRotation(const LogRotateOptions& options);
+
+    virtual ~FileLogPolicy();
+
+ private:
+    struct Background {
+      std::thread thread;
+      std::mutex mutex;  // stop
+      std::condition_variable cv;
+      bool stop;
+      int32_t pid;
+    };
+
+    /* Holds _mutex while the background thread runs */
+    std::unique_lock<std::mutex> Lock();
+
+    void OpenOstream();
+    void CloseFile();
+    /* Rotate first if size, day or pid call for a new file */
+    void Reserve(size_t size, time_t timestamp);
+    void WriteBuffer();
+    /* write(2) the whole iovec array, retrying short writes */
+    void WriteFully(const struct iovec* iov, int count);
+    void Sync(int fd);
+    void BackgroundLoop(Background* background);
+    void StopBackground();
+
+ private:
+    int _fd;
+    std::string _buffer; /*writes waiting for write(2)*/
+    LogDurability _durability;
+    std::unique_ptr<LogRotator> _rotator;
+    std::mutex _mutex;
+    std::unique_ptr<Background> _background;
+};
+
+/* Writes through a shared mapping of the log file, a line costs a memcpy
+ * and no system call. The pages belong to the kernel, so what was
+ * copied survives a crash of the process (not of the machine). The file
+ * is extended and mapped kMapBytes at a time with the space allocated up
+ * front, CloseOstream trims it to the bytes written. A file left by a
+ * crash ends in zeros up to the end of its last chunk. */
+class MmapFileLogPolicy : public RollingLogPolicy {
+ public:
+    MmapFileLogPolicy():
+      _fd(-1),
+      _map(nullptr),
+      _map_offset(0),
+      _offset(0) {}
+
+    using RollingLogPolicy::OpenOstream;
+
+    void CloseOstream();
+
+    void Write(const std::string& msg, time_t timestamp);
+    void Write(const char* data, size_t size, time_t timestamp);
+    void Write(const struct iovec* iov, int count, time_t timestamp);
+
+    /* Start writeback of the dirty pages, without waiting */
+    void Flush();
+
+    virtual ~MmapFileLogPolicy();
+
+ private:
+    static const size_t kMapBytes = 16 << 20;
+
+    void OpenOstream();
+    void Reserve(size_t size, time_t timestamp);
+    void Append(const char* data, size_t size);
+    /* Move the mapping to the chunk at file offset, growing the file */
+    void MapChunk(size_t offset);
+    void Unmap();
+
+ private:
+    int _fd;
+    char* _map;
+    size_t _map_offset;  // file offset of the mapped chunk
+    std::atomic<size_t> _offset;  // bytes written to the file
 };
 
 }  // namespace utils
@@ -4,12 +4,19 @@
 #ifndef SRC_UTILS_LRU_CACHE_H_
 #define SRC_UTILS_LRU_CACHE_H_
 
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
 #include <unordered_map>
 #include <utility>
 #include <list>
 #include <string>
 #include <thread>
+#include <tuple>
 #include <ostream>
+#include <vector>
 
 // @Author bjzhangdongyue
 // @Date   2017-03-27 11:30:00
@@ -23,10 +30,107 @@ using std::string;
 
 namespace utils {
 
-template <typename TKEY, typename TVALUE>
+/* @Brief Finalizer of murmur3. std::hash of integers is the identity on
+ *        libstdc++, mix the bits before using them to pick a shard or
+ *        a bucket, so sequential keys still spread out.
+ * */
+inline uint64_t LRUHashMix(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return h;
+}
+
+/* @Brief Hit/miss accounting, summed over shards by the threadsafe caches */
+struct LRUStats {
+  LRUStats() : hits(0), misses(0), expirations(0), evictions(0) {}
+
+  LRUStats& operator+=(const LRUStats& other) {
+    hits += other.hits;
+    misses += other.misses;
+    expirations += other.expirations;
+    evictions += other.evictions;
+    return *this;
+  }
+
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t expirations;
+  uint64_t evictions;
+};
+
+inline std::ostream& operator<<(std::ostream &out, const LRUStats& stats) {
+  out << "hits=" << stats.hits << " misses=" << stats.misses
+      << " expirations=" << stats.expirations
+      << " evictions=" << stats.evictions;
+  return out;
+}
+
+/* @Brief Counters of one cache. A cache is only ever written by the thread
+ *        holding it, so a relaxed load + store is enough, no locked
+ *        read-modify-write on the Get path. Snapshot() is safe from any
+ *        thread.
+ * */
+class LRUCounters {
+ public:
+  LRUCounters() : hits_(0), misses_(0), expirations_(0), evictions_(0) {}
+
+  void Hit() { Bump(&hits_); }
+  void Miss() { Bump(&misses_); }
+  void Expire() { Bump(&expirations_); }
+  void Evict() { Bump(&evictions_); }
+
+  LRUStats Snapshot() const {
+    LRUStats stats;
+    stats.hits = hits_.load(std::memory_order_relaxed);
+    stats.misses = misses_.load(std::memory_order_relaxed);
+    stats.expirations = expirations_.load(std::memory_order_relaxed);
+    stats.evictions = evictions_.load(std::memory_order_relaxed);
+    return stats;
+  }
+
+ private:
+  static void Bump(std::atomic<uint64_t>* counter) {
+    counter->store(counter->load(std::memory_order_relaxed) + 1,
+                   std::memory_order_relaxed);
+  }
+
+  std::atomic<uint64_t> hits_;
+  std::atomic<uint64_t> misses_;
+  std::atomic<uint64_t> expirations_;
+  std::atomic<uint64_t> evictions_;
+};
+
+template <typename TKEY, typename TVALUE, typename THASH = std::hash<TKEY> >
 class LRUCache {
  public:
-  explicit LRUCache(int capacity) : capacity_(capacity) {}
+  using Weigher = std::function<size_t(const TKEY&, const TVALUE&)>;
+
+  explicit LRUCache(int capacity)
+    : probe_(nullptr),
+      cache_(0, SlotHash(), SlotEqual(&probe_)),
+      capacity_(capacity),
+      max_bytes_(0),
+      resident_bytes_(0),
+      now_ms_(NowMs()),
+      tick_ms_(kDefaultTickMs),
+      wheel_tick_(0) {}
+
+  /* @Brief Byte budget mode, no limit on the entry count.
+   * @params[in] weigher : bytes charged for an entry, e.g. key and value
+   *            payload plus a per-node overhead. Evaluated once on insert.
+   *            An entry heavier than max_bytes on its own is not cached.
+   * */
+  LRUCache(size_t max_bytes, Weigher weigher)
+    : probe_(nullptr),
+      cache_(0, SlotHash(), SlotEqual(&probe_)),
+      capacity_(0),
+      max_bytes_(max_bytes),
+      resident_bytes_(0),
+      weigher_(weigher),
+      now_ms_(NowMs()),
+      tick_ms_(kDefaultTickMs),
+      wheel_tick_(0) {}
   
   /* @params[in] function : 
    *            Implement it when need a MISSING judgement,
@@ -35,115 +139,637 @@ class LRUCache {
    *            Default [nullptr]
    * */
   template <typename F>
-  TVALUE* Get(TKEY key, F function = nullptr);
+  TVALUE* Get(const TKEY& key, F function = nullptr);
+
+  /* @Brief Get with the hash computed beforehand, e.g. the one a sharded
+   *        cache picked the shard with, so the key is hashed only once.
+   *        key need not be a TKEY either, a const char* can probe
+   *        std::string keys with no string built.
+   * @params[in] hash : THASH()(k) of the cached key k that key stands for
+   * @params[in] equal : bool equal(const K& key, const TKEY& cached)
+   * */
+  template <typename K, typename EQ, typename F>
+  TVALUE* Get(size_t hash, const K& key, EQ equal, F function = nullptr);
   
+  /* key and value are moved into the cache, pass rvalues to avoid any
+   * copy. The key is stored once, in the recency list, the index points
+   * at it. */
   void Set(TKEY key, TVALUE value);
 
+  /* @Brief Set with a time to live. The deadline is NowMs() + ttl_ms,
+   *        read here. The entry reads as EXPIRED once NowMs() passes the
+   *        deadline, a Set of the key then replaces it, and Advance()
+   *        reclaims it even if nobody touches it again.
+   * */
+  void Set(TKEY key, TVALUE value, uint32_t ttl_ms);
+
+  /* @Brief Construct the value in place from args when key is absent,
+   *        only touch the entry when it is cached (as Set does)
+   * @return the cached value, nullptr if the byte budget refused it
+   * */
+  template <typename... Args>
+  TVALUE* Emplace(TKEY key, Args&&... args);
+
+  /* @Brief Modify a live entry in place through mutate(TVALUE&) and
+   *        touch it, re-weighed in byte budget mode
+   * @return false on MISS or EXPIRED
+   * */
+  template <typename M>
+  bool Update(const TKEY& key, M mutate);
+
+  /* @return true if the key was cached */
+  bool Erase(const TKEY& key);
+
+  /* Calls visit(key, value) for every live entry, from the least to the
+   * most recently used, so Set-ing them in that order rebuilds the same
+   * recency. Does not touch the entries. Liveness is judged by NowMs(),
+   * not the cached clock, so nothing past its deadline is visited. */
+  template <typename Visitor>
+  void ForEach(Visitor visit) const;
+
+  /* ForEach, but visit(key, value, ttl_ms) also gets the time the entry
+   * has left to live, 0 for an entry set without ttl */
+  template <typename Visitor>
+  void ForEachWithTtl(Visitor visit) const;
+
+  /* Entry limit, 0 in byte budget mode */
+  size_t capacity() const {
+    return static_cast<size_t>(capacity_);
+  }
+
+  /* Room for count entries without rehashing, before a bulk load */
+  void Reserve(size_t count) {
+    cache_.reserve(count);
+  }
+
+  /* @Brief Move the cached clock used by the TTL check forward to now_ms
+   *        and reclaim expired entries from the timing wheel, at most
+   *        max_reclaim of them so a burst of expirations is spread over
+   *        several calls. Drive it periodically, e.g. from a CTimer, so
+   *        entries nobody reads again give their room back.
+   * @params[in] now_ms : a NowMs() reading, the deadlines use that clock
+   * @return number of entries reclaimed
+   * */
+  size_t Advance(uint64_t now_ms, size_t max_reclaim = 64);
+
+  size_t Advance() {
+    return Advance(NowMs());
+  }
+
+  /* Granularity and size of the timing wheel, only takes effect before
+   * the first Set with a ttl. Default 100ms x 512 slots. */
+  void InitTimerWheel(uint32_t tick_ms, uint32_t slots);
+
+  static uint64_t NowMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
   struct RETURN {
     enum type{
       NONE = 0,
       HIT = 1,
-      MISS = 2
+      MISS = 2,
+      EXPIRED = 3
     };
   };
 
+  /* Same as Get, but reports the outcome as a status code
+   * @params[out] value : points to the cached value on HIT
+   * */
+  template <typename F>
+  typename RETURN::type Lookup(const TKEY& key, TVALUE** value,
+                               F function);
+
+  /* Lookup with the hash computed beforehand, as the hashed Get */
+  template <typename K, typename EQ, typename F>
+  typename RETURN::type Lookup(size_t hash, const K& key, EQ equal,
+                               TVALUE** value, F function);
+
+  LRUStats GetStats() const {
+    return counters_.Snapshot();
+  }
+
+  /* Sum of the weights of the cached entries, 0 unless in byte budget
+   * mode. Safe to read from any thread. */
+  size_t ResidentBytes() const {
+    return resident_bytes_.load(std::memory_order_relaxed);
+  }
+
   static void SetErrMsg(int err_code, const std::string& err_str) {
     err_msg_ = {err_code, err_str};
+    last_msg_ = &err_msg_;
+  }
+
+  /* Only records which of the canned messages applies, the pair itself
+   * is built once per process */
+  static void SetStatus(typename RETURN::type code) {
+    last_msg_ = &kStatusMsgs[code];
   }
 
   inline const pair<int, string>& GetErrMsg() const {
-    return err_msg_;
+    return *last_msg_;
   }
 
  private:
-  LRUCache(const LRUCache<TKEY, TVALUE>&) = delete;
-  LRUCache(const LRUCache<TKEY, TVALUE>&&) = delete;
-  LRUCache<TKEY, TVALUE>& operator=(const LRUCache<TKEY, TVALUE>&) = delete;
+  LRUCache(const LRUCache&) = delete;
+  LRUCache(const LRUCache&&) = delete;
+  LRUCache& operator=(const LRUCache&) = delete;
 
  private:
   using L = list<TKEY>;
-  using PL =  pair<TVALUE, typename L::iterator>;
-  using HPL =  unordered_map<TKEY, PL>;
+
+  /* Stands for a key other than TKEY in a hashed Lookup */
+  struct Probe {
+    bool (*equal)(const Probe* probe, const TKEY& key);
+  };
+
+  template <typename K, typename EQ>
+  struct ProbeOf : Probe {
+    ProbeOf(const K& k, EQ eq) : key(k), key_equal(eq) {
+      this->equal = &Equal;
+    }
+
+    static bool Equal(const Probe* probe, const TKEY& key) {
+      const ProbeOf* self = static_cast<const ProbeOf*>(probe);
+      return self->key_equal(self->key, key);
+    }
+
+    const K& key;
+    EQ key_equal;
+  };
+
+  /* Key of the index. The hash is computed once, when the key is set,
+   * and the key itself lives in the recency list. A slot without key
+   * stands for probe_ of the hashed Lookup in progress. */
+  struct Slot {
+    Slot(size_t h, const TKEY* k) : hash(h), key(k) {}
+
+    size_t hash;
+    const TKEY* key;
+  };
+
+  struct SlotHash {
+    size_t operator()(const Slot& slot) const noexcept {
+      return slot.hash;
+    }
+  };
+
+  struct SlotEqual {
+    explicit SlotEqual(const Probe* const* p) : probe(p) {}
+
+    bool operator()(const Slot& a, const Slot& b) const {
+      if (a.hash != b.hash)
+        return false;
+      if (nullptr == a.key)
+        return (*probe)->equal(*probe, *b.key);
+      if (nullptr == b.key)
+        return (*probe)->equal(*probe, *a.key);
+      return *a.key == *b.key;
+    }
+
+    const Probe* const* probe;  // the cache's probe_
+  };
+
+  struct Entry {
+    template <typename... Args>
+    explicit Entry(uint64_t expire, Args&&... args)
+      : value(std::forward<Args>(args)...),
+        weight(0),
+        expire_at(expire),
+        wheel_prev(nullptr),
+        wheel_next(nullptr) {}
+
+    TVALUE value;
+    typename L::iterator pos;  // node of the key in used_
+    size_t weight;
+    uint64_t expire_at;        // kNeverExpire without ttl
+    Entry* wheel_prev;         // links in the timing wheel slot
+    Entry* wheel_next;
+  };
+
+  static const uint64_t kNeverExpire = ~0ULL;
+  static const uint32_t kDefaultTickMs = 100;
+  static const uint32_t kDefaultWheelSlots = 512;
+
+  using HPL =  unordered_map<Slot, Entry, SlotHash, SlotEqual>;
+
+  typename HPL::iterator Find(const TKEY& key) {
+    return cache_.find(Slot(hasher_(key), &key));
+  }
+
+  typename HPL::const_iterator Find(const TKEY& key) const {
+    return cache_.find(Slot(hasher_(key), &key));
+  }
+
+  /* HIT, EXPIRED or a function judgement on the entry at it */
+  template <typename F>
+  typename RETURN::type LookupAt(typename HPL::iterator it, TVALUE** value,
+                                 F function);
 
   /* @Breif If HIT, only adjust the KEY(list used_) */
   void Touch(typename HPL::iterator it);
 
   void Delete(typename HPL::iterator it);
 
+  /* Drop the least recently used entry */
+  void Evict();
+
+  /* key must not be cached, hash is hasher_(key) */
+  template <typename... Args>
+  TVALUE* Insert(size_t hash, TKEY&& key, uint64_t expire_at,
+                 Args&&... args);
+
+  /* Evict from the LRU end until back under the byte budget, keeping
+   * the MRU entry */
+  void EvictOverBudget();
+
+  Entry*& WheelSlot(uint64_t expire_at) {
+    return wheel_[(expire_at / tick_ms_) & (wheel_.size() - 1)];
+  }
+
+  void WheelLink(Entry* entry);
+  void WheelUnlink(Entry* entry);
+
+  /* The cached clock never moves back */
+  void SyncClock(uint64_t now_ms) {
+    if (now_ms > now_ms_)
+      now_ms_ = now_ms;
+  }
+
+  /* Only an entry with a ttl costs a clock read */
+  bool Expired(const Entry& entry) {
+    if (kNeverExpire == entry.expire_at)
+      return false;
+    SyncClock(NowMs());
+    return entry.expire_at <= now_ms_;
+  }
+
+  THASH hasher_;
+  const Probe* probe_;
   HPL cache_;
   L used_;
   int capacity_;
+  size_t max_bytes_;
+  std::atomic<size_t> resident_bytes_;
+  Weigher weigher_;
+  LRUCounters counters_;
+
+  uint64_t now_ms_;
+  uint32_t tick_ms_;
+  uint64_t wheel_tick_;  // next tick Advance sweeps
+  std::vector<Entry*> wheel_;
 
+  static const pair<int, string> kStatusMsgs[4];
   static thread_local pair<int ,string> err_msg_;
+  static thread_local const pair<int, string>* last_msg_;
 };  // Class LRUCache
 
-std::ostream& operator<<(std::ostream &out, const pair<int, string>& err_msg) {
+inline std::ostream& operator<<(std::ostream &out, const pair<int, string>& err_msg) {
   out << err_msg.first << " : " << err_msg.second;
   return out;
 } 
 
-template <typename TKEY, typename TVALUE>
-thread_local pair<int ,string> LRUCache<TKEY, TVALUE>::err_msg_ = 
-                          {LRUCache<TKEY, TVALUE>::RETURN::NONE, "none"};
+template <typename TKEY, typename TVALUE, typename THASH>
+const pair<int, string> LRUCache<TKEY, TVALUE, THASH>::kStatusMsgs[4] = {
+  {LRUCache<TKEY, TVALUE, THASH>::RETURN::NONE, "none"},
+  {LRUCache<TKEY, TVALUE, THASH>::RETURN::HIT, "CACHE HIT"},
+  {LRUCache<TKEY, TVALUE, THASH>::RETURN::MISS, "CACHE MISSING"},
+  {LRUCache<TKEY, TVALUE, THASH>::RETURN::EXPIRED, "CACHE EXPIRED"}
+};
+
+template <typename TKEY, typename TVALUE, typename THASH>
+thread_local pair<int ,string> LRUCache<TKEY, TVALUE, THASH>::err_msg_ = 
+                          {LRUCache<TKEY, TVALUE, THASH>::RETURN::NONE, "none"};
+
+template <typename TKEY, typename TVALUE, typename THASH>
+thread_local const pair<int, string>* LRUCache<TKEY, TVALUE, THASH>::last_msg_ =
+                          &LRUCache<TKEY, TVALUE, THASH>::kStatusMsgs[0];
+
+template <typename TKEY, typename TVALUE, typename THASH>
+template <typename F>
+TVALUE* LRUCache<TKEY, TVALUE, THASH>::Get(const TKEY& key, F function) {
+  TVALUE* value = nullptr;
+  Lookup(key, &value, function);
+  return value;
+}  // Get
+
+template <typename TKEY, typename TVALUE, typename THASH>
+template <typename K, typename EQ, typename F>
+TVALUE* LRUCache<TKEY, TVALUE, THASH>::Get(size_t hash, const K& key,
+                                           EQ equal, F function) {
+  TVALUE* value = nullptr;
+  Lookup(hash, key, equal, &value, function);
+  return value;
+}  // Get
 
-template <typename TKEY, typename TVALUE>
+template <typename TKEY, typename TVALUE, typename THASH>
 template <typename F>
-TVALUE* LRUCache<TKEY, TVALUE>::Get(TKEY key, F function) {
-  auto it = cache_.find(key);
+typename LRUCache<TKEY, TVALUE, THASH>::RETURN::type
+LRUCache<TKEY, TVALUE, THASH>::Lookup(const TKEY& key, TVALUE** value,
+                                      F function) {
+  return LookupAt(Find(key), value, function);
+}  // Lookup
 
+template <typename TKEY, typename TVALUE, typename THASH>
+template <typename K, typename EQ, typename F>
+typename LRUCache<TKEY, TVALUE, THASH>::RETURN::type
+LRUCache<TKEY, TVALUE, THASH>::Lookup(size_t hash, const K& key, EQ equal,
+                                      TVALUE** value, F function) {
+  ProbeOf<K, EQ> probe(key, equal);
+  probe_ = &probe;
+  auto it = cache_.find(Slot(hash, nullptr));
+  probe_ = nullptr;
+  return LookupAt(it, value, function);
+}  // Lookup
+
+template <typename TKEY, typename TVALUE, typename THASH>
+template <typename F>
+typename LRUCache<TKEY, TVALUE, THASH>::RETURN::type
+LRUCache<TKEY, TVALUE, THASH>::LookupAt(typename HPL::iterator it,
+                                        TVALUE** value, F function) {
   if (it == cache_.end()) {
-    err_msg_ = {RETURN::MISS, "CACHE MISSING"}; 
-    return nullptr;
+    counters_.Miss();
+    SetStatus(RETURN::MISS);
+    return RETURN::MISS;
+  }
+
+  if (Expired(it->second)) {
+    counters_.Expire();
+    SetStatus(RETURN::EXPIRED);
+    Delete(it);
+    return RETURN::EXPIRED;
   }
 
   if (nullptr != function) {
     /* You should set err_msg_ in function,
      * when it return false.
      * or it will be set default */
-    if (function(it->second.first)) {
+    SetStatus(RETURN::EXPIRED);
+    if (function(it->second.value)) {
+      counters_.Expire();
       Delete(it);
-      return nullptr;
+      return RETURN::EXPIRED;
     }
   }
 
   Touch(it);
-  err_msg_ = {RETURN::HIT, "CACHE HIT"}; 
+  counters_.Hit();
+  SetStatus(RETURN::HIT);
 
-  return &(it->second.first);
-}  // Get
+  *value = &(it->second.value);
+  return RETURN::HIT;
+}  // LookupAt
 
-template <typename TKEY, typename TVALUE>
-void LRUCache<TKEY, TVALUE>::Set(TKEY key, TVALUE value) {
-  auto it = cache_.find(key);
+template <typename TKEY, typename TVALUE, typename THASH>
+void LRUCache<TKEY, TVALUE, THASH>::Set(TKEY key, TVALUE value) {
+  size_t hash = hasher_(key);
+  auto it = cache_.find(Slot(hash, &key));
 
   if (it != cache_.end()) {
-    Touch(it);
-    return;
-  } else {
-    if (cache_.size() == capacity_) {
-      cache_.erase(used_.back());
-      used_.pop_back();
+    if (!Expired(it->second)) {
+      Touch(it);
+      return;
     }
-    used_.push_front(key);
+    Delete(it);
   }
 
-  cache_[key] = { value, used_.begin() };
+  Insert(hash, std::move(key), kNeverExpire, std::move(value));
 }  // Set
 
-template <typename TKEY, typename TVALUE>
-void LRUCache<TKEY, TVALUE>::Touch(typename HPL::iterator it) {
-  int key = it->first;
-  used_.erase(it->second.second);
-  used_.push_front(key);
-  it->second.second = used_.begin();
+template <typename TKEY, typename TVALUE, typename THASH>
+void LRUCache<TKEY, TVALUE, THASH>::Set(TKEY key, TVALUE value,
+                                        uint32_t ttl_ms) {
+  SyncClock(NowMs());
+  size_t hash = hasher_(key);
+  auto it = cache_.find(Slot(hash, &key));
+
+  if (it != cache_.end()) {
+    if (!Expired(it->second)) {
+      Touch(it);
+      return;
+    }
+    Delete(it);
+  }
+
+  if (wheel_.empty())
+    InitTimerWheel(tick_ms_, kDefaultWheelSlots);
+
+  Insert(hash, std::move(key), now_ms_ + ttl_ms, std::move(value));
+}  // Set
+
+template <typename TKEY, typename TVALUE, typename THASH>
+template <typename... Args>
+TVALUE* LRUCache<TKEY, TVALUE, THASH>::Emplace(TKEY key, Args&&... args) {
+  size_t hash = hasher_(key);
+  auto it = cache_.find(Slot(hash, &key));
+
+  if (it != cache_.end()) {
+    if (!Expired(it->second)) {
+      Touch(it);
+      return &(it->second.value);
+    }
+    Delete(it);
+  }
+
+  return Insert(hash, std::move(key), kNeverExpire,
+                std::forward<Args>(args)...);
+}  // Emplace
+
+template <typename TKEY, typename TVALUE, typename THASH>
+template <typename M>
+bool LRUCache<TKEY, TVALUE, THASH>::Update(const TKEY& key, M mutate) {
+  auto it = Find(key);
+
+  if (it == cache_.end() || Expired(it->second))
+    return false;
+
+  Touch(it);
+  mutate(it->second.value);
+
+  if (weigher_) {
+    Entry& entry = it->second;
+    size_t weight = weigher_(*entry.pos, entry.value);
+    resident_bytes_.store(ResidentBytes() - entry.weight + weight,
+                          std::memory_order_relaxed);
+    entry.weight = weight;
+    if (weight > max_bytes_)
+      Delete(it);
+    else
+      EvictOverBudget();
+  }
+
+  return true;
+}  // Update
+
+template <typename TKEY, typename TVALUE, typename THASH>
+bool LRUCache<TKEY, TVALUE, THASH>::Erase(const TKEY& key) {
+  auto it = Find(key);
+  if (it == cache_.end())
+    return false;
+
+  Delete(it);
+  return true;
+}  // Erase
+
+template <typename TKEY, typename TVALUE, typename THASH>
+template <typename Visitor>
+void LRUCache<TKEY, TVALUE, THASH>::ForEach(Visitor visit) const {
+  ForEachWithTtl([&visit](const TKEY& key, const TVALUE& value, uint32_t) {
+    visit(key, value);
+  });
+}  // ForEach
+
+template <typename TKEY, typename TVALUE, typename THASH>
+template <typename Visitor>
+void LRUCache<TKEY, TVALUE, THASH>::ForEachWithTtl(Visitor visit) const {
+  uint64_t now_ms = NowMs();
+  for (auto key = used_.rbegin(); key != used_.rend(); ++key) {
+    auto it = Find(*key);
+    uint64_t expire_at = it->second.expire_at;
+    if (kNeverExpire == expire_at)
+      visit(*key, it->second.value, 0u);
+    else if (expire_at > now_ms)  // ttl_ms was 32 bits, so is the rest
+      visit(*key, it->second.value,
+            static_cast<uint32_t>(expire_at - now_ms));
+  }
+}  // ForEachWithTtl
+
+template <typename TKEY, typename TVALUE, typename THASH>
+template <typename... Args>
+TVALUE* LRUCache<TKEY, TVALUE, THASH>::Insert(size_t hash, TKEY&& key,
+                                              uint64_t expire_at,
+                                              Args&&... args) {
+  if (!weigher_ && cache_.size() == static_cast<size_t>(capacity_))
+    Evict();
+
+  used_.push_front(std::move(key));
+  auto it = cache_.emplace(std::piecewise_construct,
+                           std::forward_as_tuple(hash, &used_.front()),
+                           std::forward_as_tuple(
+                               expire_at, std::forward<Args>(args)...)).first;
+  Entry& entry = it->second;
+  entry.pos = used_.begin();
+
+  if (weigher_) {
+    size_t weight = weigher_(used_.front(), entry.value);
+    if (weight > max_bytes_) {
+      cache_.erase(it);
+      used_.pop_front();
+      return nullptr;
+    }
+    entry.weight = weight;
+    resident_bytes_.store(ResidentBytes() + weight,
+                          std::memory_order_relaxed);
+    EvictOverBudget();
+  }
+
+  if (kNeverExpire != expire_at)
+    WheelLink(&entry);
+  return &entry.value;
+}  // Insert
+
+template <typename TKEY, typename TVALUE, typename THASH>
+void LRUCache<TKEY, TVALUE, THASH>::EvictOverBudget() {
+  while (ResidentBytes() > max_bytes_ && used_.size() > 1)
+    Evict();
+}  // EvictOverBudget
+
+template <typename TKEY, typename TVALUE, typename THASH>
+void LRUCache<TKEY, TVALUE, THASH>::InitTimerWheel(uint32_t tick_ms,
+                                            uint32_t slots) {
+  if (!wheel_.empty())
+    return;
+
+  uint32_t n = 1;
+  while (n < slots)
+    n <<= 1;
+  tick_ms_ = tick_ms > 0 ? tick_ms : 1;
+  wheel_tick_ = now_ms_ / tick_ms_;
+  wheel_.assign(n, nullptr);
+}  // InitTimerWheel
+
+template <typename TKEY, typename TVALUE, typename THASH>
+size_t LRUCache<TKEY, TVALUE, THASH>::Advance(uint64_t now_ms,
+                                              size_t max_reclaim) {
+  SyncClock(now_ms);
+  if (wheel_.empty())
+    return 0;
+
+  now_ms = now_ms_;
+  uint64_t mask = wheel_.size() - 1;
+  uint64_t target = now_ms / tick_ms_;
+  // After a long pause one revolution already covers every slot
+  if (target > wheel_tick_ + mask)
+    wheel_tick_ = target - mask;
+
+  size_t reclaimed = 0;
+  while (true) {
+    Entry* entry = wheel_[wheel_tick_ & mask];
+    while (nullptr != entry) {
+      Entry* next = entry->wheel_next;
+      if (entry->expire_at <= now_ms) {
+        // Resume from this slot on the next call
+        if (reclaimed == max_reclaim)
+          return reclaimed;
+        counters_.Expire();
+        Delete(Find(*entry->pos));
+        ++reclaimed;
+      }
+      entry = next;
+    }
+    // The current tick may still gain due entries, keep it as the cursor
+    if (wheel_tick_ >= target)
+      break;
+    ++wheel_tick_;
+  }
+
+  return reclaimed;
+}  // Advance
+
+template <typename TKEY, typename TVALUE, typename THASH>
+void LRUCache<TKEY, TVALUE, THASH>::WheelLink(Entry* entry) {
+  Entry*& head = WheelSlot(entry->expire_at);
+  entry->wheel_prev = nullptr;
+  entry->wheel_next = head;
+  if (nullptr != head)
+    head->wheel_prev = entry;
+  head = entry;
+}  // WheelLink
+
+template <typename TKEY, typename TVALUE, typename THASH>
+void LRUCache<TKEY, TVALUE, THASH>::WheelUnlink(Entry* entry) {
+  if (nullptr != entry->wheel_prev)
+    entry->wheel_prev->wheel_next = entry->wheel_next;
+  else
+    WheelSlot(entry->expire_at) = entry->wheel_next;
+  if (nullptr != entry->wheel_next)
+    entry->wheel_next->wheel_prev = entry->wheel_prev;
+}  // WheelUnlink
+
+template <typename TKEY, typename TVALUE, typename THASH>
+void LRUCache<TKEY, TVALUE, THASH>::Touch(typename HPL::iterator it) {
+  used_.splice(used_.begin(), used_, it->second.pos);
 }  // Touch
 
-template <typename TKEY, typename TVALUE>
-void LRUCache<TKEY, TVALUE>::Delete(typename HPL::iterator it) {
-  used_.erase(it->second.second);
+template <typename TKEY, typename TVALUE, typename THASH>
+void LRUCache<TKEY, TVALUE, THASH>::Delete(typename HPL::iterator it) {
+  if (it->second.weight > 0)
+    resident_bytes_.store(ResidentBytes() - it->second.weight,
+                          std::memory_order_relaxed);
+  if (kNeverExpire != it->second.expire_at)
+    WheelUnlink(&it->second);
+  typename L::iterator pos = it->second.pos;
   cache_.erase(it);
+  used_.erase(pos);
 }  // Delete
 
+template <typename TKEY, typename TVALUE, typename THASH>
+void LRUCache<TKEY, TVALUE, THASH>::Evict() {
+  Delete(Find(used_.back()));
+  counters_.Evict();
+}  // Evict
+
 }  // namespace utils
 
 #endif  // SRC_UTILS_LRU_CACHE_H_
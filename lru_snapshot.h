@@ -0,0 +1,314 @@
+// Copyright (c) 2016-2017 DONGYUE.ZHANG
+// mail to zhangdy1986(at)gmail.com
+
+#ifndef SRC_UTILS_LRU_SNAPSHOT_H_
+#define SRC_UTILS_LRU_SNAPSHOT_H_
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "lru_cache.h"
+#include "sharded_lru_cache.h"
+
+// @Author bjzhangdongyue
+// @Brief  Snapshot an LRU cache to a file and warm it back up at start
+//
+// File: "LRUS" magic, version, record count and wall clock time of the
+// dump, then the records from the least to the most recently used, so
+// loading is a forward pass of Set calls that rebuilds the recency order.
+// A record is the ttl left in ms (0 for none), the key and the value. On
+// load the time since the dump is taken off the ttl, entries that expired
+// meanwhile are dropped.
+//
+// The file is written under a temporary name, fsynced, renamed, and the
+// directory fsynced, so even a power loss leaves the old snapshot or the
+// new one, never a torn file.
+//
+// Keys and values go through SnapshotCodec<T>. Trivial types and
+// std::string are covered, specialize it for anything else.
+
+namespace utils {
+
+template <typename T, typename Enable = void>
+struct SnapshotCodec {
+  // std::is_trivially_copyable is missing from gcc 4.8
+  static_assert(std::is_trivial<T>::value,
+                "specialize SnapshotCodec for this type");
+
+  static void Encode(const T& value, std::string* out) {
+    out->append(reinterpret_cast<const char*>(&value), sizeof(T));
+  }
+
+  /* @return false on truncated input */
+  static bool Decode(const char** pos, const char* end, T* value) {
+    if (static_cast<size_t>(end - *pos) < sizeof(T))
+      return false;
+    memcpy(value, *pos, sizeof(T));
+    *pos += sizeof(T);
+    return true;
+  }
+};
+
+template <>
+struct SnapshotCodec<std::string> {
+  static void Encode(const std::string& value, std::string* out) {
+    uint32_t len = static_cast<uint32_t>(value.size());
+    out->append(reinterpret_cast<const char*>(&len), sizeof(len));
+    out->append(value);
+  }
+
+  static bool Decode(const char** pos, const char* end, std::string* value) {
+    uint32_t len = 0;
+    if (static_cast<size_t>(end - *pos) < sizeof(len))
+      return false;
+    memcpy(&len, *pos, sizeof(len));
+    *pos += sizeof(len);
+    if (static_cast<size_t>(end - *pos) < len)
+      return false;
+    value->assign(*pos, len);
+    *pos += len;
+    return true;
+  }
+};
+
+template <typename TKEY, typename TVALUE,
+          typename KCODEC = SnapshotCodec<TKEY>,
+          typename VCODEC = SnapshotCodec<TVALUE> >
+class LRUSnapshot {
+ public:
+  /* @params[in] cache : LRUCache (caller holds its lock) or
+   *            ShardedLRUCache (locked one shard at a time)
+   * */
+  template <typename TCACHE>
+  static bool Dump(TCACHE* cache, const std::string& path);
+
+  /* Dump from a detached thread, the caller is never blocked and
+   * readers only wait while their own shard is being copied. The cache
+   * must outlive the dump, done(ok) is called on that thread at its end.
+   * */
+  static void DumpAsync(ShardedLRUCache<TKEY, TVALUE>* cache,
+                        const std::string& path,
+                        std::function<void(bool)> done = nullptr) {
+    std::thread([cache, path, done] {
+      bool ok = Dump(cache, path);
+      if (done)
+        done(ok);
+    }).detach();
+  }
+
+  /* @return false if the file is missing or corrupt, records decoded
+   *         before the corruption are kept */
+  static bool Load(const std::string& path, LRUCache<TKEY, TVALUE>* cache);
+
+  /* Bulk insert through MultiSet, one lock per shard per batch */
+  static bool Load(const std::string& path,
+                   ShardedLRUCache<TKEY, TVALUE>* cache);
+
+ private:
+  static const uint32_t kMagic = 0x5355524c;  // "LRUS"
+  static const uint32_t kVersion = 2;
+  static const size_t kLoadBatch = 4096;
+
+  struct FileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t count;
+    uint64_t saved_at_ms;  // system clock
+  };
+
+  static uint64_t WallMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+  }
+
+  /* Write data to path through a temporary file, durably */
+  static bool WriteFile(const std::string& path, const std::string& data);
+
+  /* mmap the file, call reserve(count) once with a count the file size
+   * vouches for, then insert(key, value, ttl_ms) for every record still
+   * alive */
+  template <typename R, typename F>
+  static bool ReadFile(const std::string& path, R reserve, F insert);
+};  // Class LRUSnapshot
+
+template <typename TKEY, typename TVALUE, typename KCODEC, typename VCODEC>
+template <typename TCACHE>
+bool LRUSnapshot<TKEY, TVALUE, KCODEC, VCODEC>::Dump(TCACHE* cache,
+                                                     const std::string& path) {
+  std::string records;
+  FileHeader header = { kMagic, kVersion, 0, 0 };
+  records.append(reinterpret_cast<const char*>(&header), sizeof(header));
+
+  cache->ForEachWithTtl([&records, &header](const TKEY& key,
+                                            const TVALUE& value,
+                                            uint32_t ttl_ms) {
+    records.append(reinterpret_cast<const char*>(&ttl_ms), sizeof(ttl_ms));
+    KCODEC::Encode(key, &records);
+    VCODEC::Encode(value, &records);
+    ++header.count;
+  });
+  // The ttls were read against the clock just now
+  header.saved_at_ms = WallMs();
+  memcpy(&records[0], &header, sizeof(header));
+
+  return WriteFile(path, records);
+}  // Dump
+
+template <typename TKEY, typename TVALUE, typename KCODEC, typename VCODEC>
+bool LRUSnapshot<TKEY, TVALUE, KCODEC, VCODEC>::WriteFile(
+    const std::string& path, const std::string& data) {
+  std::string tmp_path = path + ".tmp";
+  int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                0644);
+  if (fd < 0)
+    return false;
+
+  const char* pos = data.data();
+  const char* end = pos + data.size();
+  while (pos < end) {
+    ssize_t n = write(fd, pos, end - pos);
+    if (n < 0 && EINTR == errno)
+      continue;
+    if (n <= 0)
+      break;
+    pos += n;
+  }
+  // The data has to be on disk before the rename makes it the snapshot
+  bool ok = pos == end && 0 == fsync(fd);
+  ok = 0 == close(fd) && ok;
+  if (!ok || 0 != rename(tmp_path.c_str(), path.c_str())) {
+    unlink(tmp_path.c_str());
+    return false;
+  }
+
+  // And the rename itself survives a power loss once the directory is
+  std::string::size_type slash = path.rfind('/');
+  std::string dir = std::string::npos == slash ? "." :
+      0 == slash ? "/" : path.substr(0, slash);
+  int dir_fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd < 0)
+    return false;
+  ok = 0 == fsync(dir_fd);
+  close(dir_fd);
+  return ok;
+}  // WriteFile
+
+template <typename TKEY, typename TVALUE, typename KCODEC, typename VCODEC>
+template <typename R, typename F>
+bool LRUSnapshot<TKEY, TVALUE, KCODEC, VCODEC>::ReadFile(
+    const std::string& path, R reserve, F insert) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  if (0 != fstat(fd, &st) ||
+      static_cast<size_t>(st.st_size) < sizeof(FileHeader)) {
+    close(fd);
+    return false;
+  }
+
+  size_t size = st.st_size;
+  void* addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (MAP_FAILED == addr)
+    return false;
+  madvise(addr, size, MADV_SEQUENTIAL);
+
+  const char* pos = static_cast<const char*>(addr);
+  const char* end = pos + size;
+  FileHeader header;
+  memcpy(&header, pos, sizeof(header));
+  pos += sizeof(header);
+
+  // Every record carries its ttl, a count the file cannot hold is corrupt
+  uint32_t ttl_ms = 0;
+  bool ok = kMagic == header.magic && kVersion == header.version &&
+      header.count <= (size - sizeof(header)) / sizeof(ttl_ms);
+  if (ok)
+    reserve(header.count);
+
+  uint64_t now_ms = WallMs();
+  uint64_t elapsed_ms = now_ms > header.saved_at_ms ?
+      now_ms - header.saved_at_ms : 0;
+  for (uint64_t i = 0; ok && i < header.count; ++i) {
+    TKEY key;
+    TVALUE value;
+    ok = static_cast<size_t>(end - pos) >= sizeof(ttl_ms);
+    if (!ok)
+      break;
+    memcpy(&ttl_ms, pos, sizeof(ttl_ms));
+    pos += sizeof(ttl_ms);
+    ok = KCODEC::Decode(&pos, end, &key) && VCODEC::Decode(&pos, end, &value);
+    if (!ok || (0 != ttl_ms && ttl_ms <= elapsed_ms))
+      continue;
+    insert(key, value, 0 == ttl_ms ? 0 :
+           static_cast<uint32_t>(ttl_ms - elapsed_ms));
+  }
+
+  munmap(addr, size);
+  return ok;
+}  // ReadFile
+
+template <typename TKEY, typename TVALUE, typename KCODEC, typename VCODEC>
+bool LRUSnapshot<TKEY, TVALUE, KCODEC, VCODEC>::Load(
+    const std::string& path, LRUCache<TKEY, TVALUE>* cache) {
+  return ReadFile(path,
+      [cache](uint64_t count) {
+    // Whatever the file says, no more than the cache keeps
+    if (cache->capacity() > 0)
+      cache->Reserve(count < cache->capacity() ? count : cache->capacity());
+  },
+      [cache](const TKEY& key, const TVALUE& value, uint32_t ttl_ms) {
+    if (0 == ttl_ms)
+      cache->Set(key, value);
+    else
+      cache->Set(key, value, ttl_ms);
+  });
+}  // Load
+
+template <typename TKEY, typename TVALUE, typename KCODEC, typename VCODEC>
+bool LRUSnapshot<TKEY, TVALUE, KCODEC, VCODEC>::Load(
+    const std::string& path, ShardedLRUCache<TKEY, TVALUE>* cache) {
+  std::vector<pair<TKEY, TVALUE> > batch;
+  std::vector<uint32_t> ttls;
+  batch.reserve(kLoadBatch);
+  ttls.reserve(kLoadBatch);
+
+  bool ok = ReadFile(path,
+      [](uint64_t) {},
+      [cache, &batch, &ttls](const TKEY& key, const TVALUE& value,
+                             uint32_t ttl_ms) {
+    batch.push_back(pair<TKEY, TVALUE>(key, value));
+    ttls.push_back(ttl_ms);
+    if (batch.size() == kLoadBatch) {
+      cache->MultiSet(batch, ttls);
+      batch.clear();
+      ttls.clear();
+    }
+  });
+
+  if (!batch.empty())
+    cache->MultiSet(batch, ttls);
+  return ok;
+}  // Load
+
+}  // namespace utils
+
+#endif  // SRC_UTILS_LRU_SNAPSHOT_H_
+
+/* vim :set ts=2 sts=2 sw=2 tw=80 et */
@@ -0,0 +1,296 @@
+// Copyright (c) 2016-2017 DONGYUE.ZHANG
+// mail to zhangdy1986(at)gmail.com
+
+#ifndef SRC_UTILS_READ_THROUGH_CACHE_H_
+#define SRC_UTILS_READ_THROUGH_CACHE_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include "base_storage.h"
+#include "sharded_lru_cache.h"
+
+// @Author bjzhangdongyue
+// @Brief  Read-through cache in front of a Storage<StoragePolicy>
+// @Note   threadsafe
+//
+// A miss loads the key from the storage and caches it. Concurrent misses
+// of the same key wait for the one load in flight instead of each hitting
+// the backend. Entries expire through the per-entry TTL of LRUCache. With
+// a refresh interval, an entry older than it is still served to everybody
+// while a single caller reloads it.
+
+namespace utils {
+
+struct ReadThroughStats {
+  ReadThroughStats()
+    : hits(0), misses(0), backend_calls(0), coalesced(0),
+      stale_served(0), refresh_errors(0) {}
+
+  /* Loads a cache without single flight would have issued on top */
+  uint64_t backend_calls_saved() const {
+    return coalesced + stale_served;
+  }
+
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t backend_calls;
+  uint64_t coalesced;       // misses that waited on another caller's load
+  uint64_t stale_served;    // stale reads while another caller refreshed
+  uint64_t refresh_errors;  // failed refreshes, the leader got stale data
+};
+
+template <typename TKEY, typename TVALUE, typename StoragePolicy>
+class ReadThroughCache {
+ public:
+  using HandlerType = typename StoragePolicy::HandlerType;
+  using ReturnType = typename StoragePolicy::ReturnType;
+
+  /* Builds the storage request of a key, e.g. {"GET", key} for redis */
+  using RequestBuilder = std::function<HandlerType(const TKEY&)>;
+
+  /* Turns a storage reply into a value, false when the key does not
+   * exist. Not found results are not cached. */
+  using ReplyParser = std::function<bool(ReturnType&, TVALUE*)>;
+
+  /* @params[in] storage : initialized by the caller, must outlive this */
+  ReadThroughCache(Storage<StoragePolicy>* storage,
+                   int capacity,
+                   RequestBuilder builder,
+                   ReplyParser parser,
+                   int shard_num = 16);
+
+  /* @params[in] ttl_ms : per-entry TTL of the cached values, an expired
+   *            entry is a miss and every caller waits for the reload.
+   *            0 keeps entries until evicted.
+   * @params[in] refresh_ms : an entry older than this (and younger than
+   *            ttl_ms) is reloaded by one caller while the others keep
+   *            getting the stale value. 0 disables.
+   * */
+  void SetExpire(uint32_t ttl_ms, uint32_t refresh_ms) {
+    ttl_ms_ = ttl_ms;
+    refresh_ms_ = refresh_ms;
+  }
+
+  /* @return false if the key does not exist in the storage
+   * @throw  whatever Storage::Get throws, also to the waiting callers
+   * */
+  bool Get(const TKEY& key, TVALUE* value);
+
+  ReadThroughStats GetStats() const;
+
+  /* Moves the cached clock and reclaims expired entries, see
+   * LRUCache::Advance. Drive it periodically when ttl_ms is set. */
+  size_t Advance() {
+    return cache_.Advance();
+  }
+
+ private:
+  ReadThroughCache(const ReadThroughCache&) = delete;
+  ReadThroughCache& operator=(const ReadThroughCache&) = delete;
+
+ private:
+  struct Slot {
+    TVALUE value;
+    uint64_t refresh_at;  // NowMs() deadline, unused without refresh_ms
+  };
+
+  /* One load in flight, shared by the leader and the waiters */
+  struct Flight {
+    Flight() : done(false), found(false) {}
+
+    std::mutex lock;
+    std::condition_variable done_cv;
+    bool done;
+    bool found;
+    TVALUE value;
+    std::exception_ptr error;
+  };
+
+  /* @params[out] leader : true if the caller has to run the load */
+  std::shared_ptr<Flight> JoinFlight(const TKEY& key, bool* leader);
+
+  /* Run by the leader: load, cache, then release the waiters. A flight
+   * that ended between the leader's miss and JoinFlight has filled the
+   * cache already, its value is taken without a backend call. */
+  void Load(const TKEY& key, Flight* flight);
+
+  /* Not due for a refresh */
+  bool Fresh(const Slot& slot) const {
+    return 0 == refresh_ms_ ||
+        LRUCache<TKEY, Slot>::NowMs() < slot.refresh_at;
+  }
+
+  static void Bump(std::atomic<uint64_t>* counter) {
+    counter->fetch_add(1, std::memory_order_relaxed);
+  }
+
+  Storage<StoragePolicy>* storage_;
+  RequestBuilder builder_;
+  ReplyParser parser_;
+  ShardedLRUCache<TKEY, Slot> cache_;
+  uint32_t ttl_ms_;
+  uint32_t refresh_ms_;
+
+  std::mutex flights_lock_;
+  std::unordered_map<TKEY, std::shared_ptr<Flight> > flights_;
+
+  std::atomic<uint64_t> hits_;
+  std::atomic<uint64_t> misses_;
+  std::atomic<uint64_t> backend_calls_;
+  std::atomic<uint64_t> coalesced_;
+  std::atomic<uint64_t> stale_served_;
+  std::atomic<uint64_t> refresh_errors_;
+};  // Class ReadThroughCache
+
+template <typename TKEY, typename TVALUE, typename StoragePolicy>
+ReadThroughCache<TKEY, TVALUE, StoragePolicy>::ReadThroughCache(
+    Storage<StoragePolicy>* storage,
+    int capacity,
+    RequestBuilder builder,
+    ReplyParser parser,
+    int shard_num)
+    : storage_(storage),
+      builder_(builder),
+      parser_(parser),
+      cache_(capacity, shard_num),
+      ttl_ms_(0),
+      refresh_ms_(0),
+      hits_(0),
+      misses_(0),
+      backend_calls_(0),
+      coalesced_(0),
+      stale_served_(0),
+      refresh_errors_(0) {}
+
+template <typename TKEY, typename TVALUE, typename StoragePolicy>
+bool ReadThroughCache<TKEY, TVALUE, StoragePolicy>::Get(const TKEY& key,
+                                                        TVALUE* value) {
+  bool leader = false;
+  Slot slot;
+
+  if (cache_.Get(key, &slot)) {
+    if (Fresh(slot)) {
+      Bump(&hits_);
+      *value = slot.value;
+      return true;
+    }
+
+    std::shared_ptr<Flight> flight = JoinFlight(key, &leader);
+    if (leader) {
+      Load(key, flight.get());
+      if (nullptr == flight->error) {
+        if (flight->found)
+          *value = flight->value;
+        return flight->found;
+      }
+      // The backend was called, nothing saved
+      Bump(&refresh_errors_);
+    } else {
+      Bump(&stale_served_);
+    }
+
+    *value = slot.value;
+    return true;
+  }
+
+  Bump(&misses_);
+  std::shared_ptr<Flight> flight = JoinFlight(key, &leader);
+  if (leader) {
+    Load(key, flight.get());
+  } else {
+    Bump(&coalesced_);
+    std::unique_lock<std::mutex> guard(flight->lock);
+    flight->done_cv.wait(guard, [&flight] { return flight->done; });
+  }
+
+  if (nullptr != flight->error)
+    std::rethrow_exception(flight->error);
+
+  if (flight->found)
+    *value = flight->value;
+  return flight->found;
+}  // Get
+
+template <typename TKEY, typename TVALUE, typename StoragePolicy>
+std::shared_ptr<typename ReadThroughCache<TKEY, TVALUE, StoragePolicy>::Flight>
+ReadThroughCache<TKEY, TVALUE, StoragePolicy>::JoinFlight(const TKEY& key,
+                                                          bool* leader) {
+  std::lock_guard<std::mutex> guard(flights_lock_);
+  std::shared_ptr<Flight>& flight = flights_[key];
+  *leader = !flight;
+  if (*leader)
+    flight = std::make_shared<Flight>();
+  return flight;
+}  // JoinFlight
+
+template <typename TKEY, typename TVALUE, typename StoragePolicy>
+void ReadThroughCache<TKEY, TVALUE, StoragePolicy>::Load(const TKEY& key,
+                                                         Flight* flight) {
+  bool found = false;
+  TVALUE value;
+  std::exception_ptr error;
+  Slot cached;
+
+  if (cache_.Get(key, &cached) && Fresh(cached)) {
+    found = true;
+    value = cached.value;
+  } else {
+    try {
+      HandlerType handler = builder_(key);
+      Bump(&backend_calls_);
+      ReturnType reply = storage_->Get(handler);
+      found = parser_(reply, &value);
+    } catch (...) {
+      error = std::current_exception();
+    }
+
+    if (nullptr == error) {
+      cache_.Erase(key);
+      if (found) {
+        Slot slot{value, LRUCache<TKEY, Slot>::NowMs() + refresh_ms_};
+        if (ttl_ms_ > 0)
+          cache_.Set(key, slot, ttl_ms_);
+        else
+          cache_.Set(key, slot);
+      }
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(flights_lock_);
+    flights_.erase(key);
+  }
+
+  std::lock_guard<std::mutex> guard(flight->lock);
+  flight->found = found;
+  flight->value = value;
+  flight->error = error;
+  flight->done = true;
+  flight->done_cv.notify_all();
+}  // Load
+
+template <typename TKEY, typename TVALUE, typename StoragePolicy>
+ReadThroughStats
+ReadThroughCache<TKEY, TVALUE, StoragePolicy>::GetStats() const {
+  ReadThroughStats stats;
+  stats.hits = hits_.load(std::memory_order_relaxed);
+  stats.misses = misses_.load(std::memory_order_relaxed);
+  stats.backend_calls = backend_calls_.load(std::memory_order_relaxed);
+  stats.coalesced = coalesced_.load(std::memory_order_relaxed);
+  stats.stale_served = stale_served_.load(std::memory_order_relaxed);
+  stats.refresh_errors = refresh_errors_.load(std::memory_order_relaxed);
+  return stats;
+}  // GetStats
+
+}  // namespace utils
+
+#endif  // SRC_UTILS_READ_THROUGH_CACHE_H_
+
+/* vim :set ts=2 sts=2 sw=2 tw=80 et */
@@ -0,0 +1,370 @@
+// Copyright (c) 2016-2017 DONGYUE.ZHANG
+// mail to zhangdy1986(at)gmail.com
+
+#ifndef SRC_UTILS_SHARDED_LRU_CACHE_H_
+#define SRC_UTILS_SHARDED_LRU_CACHE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "lru_cache.h"
+
+// @Author bjzhangdongyue
+// @Brief  Sharded LRU cache
+// @Note   threadsafe. Keys are hashed into N independently locked
+//         LRUCache shards, so handlers touching different shards never
+//         contend on the same mutex. Recency is tracked per shard.
+
+namespace utils {
+
+template <typename TKEY, typename TVALUE, typename THASH = std::hash<TKEY> >
+class ShardedLRUCache {
+ public:
+  /* @params[in] capacity : total entries, split evenly over the shards,
+   *            the first capacity % shard_num shards get one more. A shard
+   *            holds at least one entry, so below shard_num the cache
+   *            holds shard_num.
+   * @params[in] shard_num : rounded up to a power of two, default 16
+   * */
+  explicit ShardedLRUCache(int capacity, int shard_num = 16);
+
+  using Weigher = typename LRUCache<TKEY, TVALUE, THASH>::Weigher;
+
+  /* Byte budget mode, max_bytes is split over the shards the same way */
+  ShardedLRUCache(size_t max_bytes, Weigher weigher, int shard_num = 16);
+
+  /* Same semantics as LRUCache::Get, but the value is copied out while
+   * the shard lock is held: a pointer into a shard would dangle as soon
+   * as another thread evicts the entry.
+   * @params[out] value : filled on HIT, untouched otherwise
+   * @return true on HIT
+   * */
+  template <typename F>
+  bool Get(const TKEY& key, TVALUE* value, F function);
+
+  bool Get(const TKEY& key, TVALUE* value) {
+    return Get(key, value, static_cast<bool(*)(const TVALUE&)>(nullptr));
+  }
+
+  /* Arguments are moved into the shard */
+  void Set(TKEY key, TVALUE value);
+
+  void Set(TKEY key, TVALUE value, uint32_t ttl_ms);
+
+  /* LRUCache::Update under the shard lock */
+  template <typename M>
+  bool Update(const TKEY& key, M mutate);
+
+  bool Erase(const TKEY& key);
+
+  /* LRUCache::ForEach shard by shard, visit runs under the shard lock so
+   * readers of one shard wait for that shard's walk only */
+  template <typename Visitor>
+  void ForEach(Visitor visit);
+
+  /* Same for LRUCache::ForEachWithTtl */
+  template <typename Visitor>
+  void ForEachWithTtl(Visitor visit);
+
+  /* @Brief Batch Get. Keys are hashed up front and grouped by shard, so
+   *        every shard lock is taken once per batch, and the shard looks
+   *        them up by that hash instead of hashing them again.
+   * @params[out] hits : (position in keys, value) of every HIT
+   * @params[out] misses : position in keys of every MISS or EXPIRED,
+   *            the keys to fetch from the backend
+   * */
+  template <typename F>
+  void MultiGet(const std::vector<TKEY>& keys,
+                std::vector<pair<size_t, TVALUE> >* hits,
+                std::vector<size_t>* misses,
+                F function);
+
+  void MultiGet(const std::vector<TKEY>& keys,
+                std::vector<pair<size_t, TVALUE> >* hits,
+                std::vector<size_t>* misses) {
+    MultiGet(keys, hits, misses,
+             static_cast<bool(*)(const TVALUE&)>(nullptr));
+  }
+
+  /* @Brief Batch Set, one lock per shard touched */
+  void MultiSet(const std::vector<pair<TKEY, TVALUE> >& items) {
+    MultiSet(items, std::vector<uint32_t>());
+  }
+
+  /* @params[in] ttl_ms : per item, 0 for no ttl. Empty for none at all. */
+  void MultiSet(const std::vector<pair<TKEY, TVALUE> >& items,
+                const std::vector<uint32_t>& ttl_ms);
+
+  /* LRUCache::Advance on every shard, one shard lock at a time
+   * @params[in] max_reclaim : per shard
+   * */
+  size_t Advance(uint64_t now_ms, size_t max_reclaim = 64);
+
+  size_t Advance() {
+    return Advance(LRUCache<TKEY, TVALUE, THASH>::NowMs());
+  }
+
+  /* Sum of the shard counters, no shard lock is taken */
+  LRUStats GetStats() const {
+    LRUStats stats;
+    for (uint32_t i = 0; i <= shard_mask_; ++i)
+      stats += shards_[i]->cache.GetStats();
+    return stats;
+  }
+
+  size_t ResidentBytes() const {
+    size_t bytes = 0;
+    for (uint32_t i = 0; i <= shard_mask_; ++i)
+      bytes += shards_[i]->cache.ResidentBytes();
+    return bytes;
+  }
+
+  int shard_num() const {
+    return shard_mask_ + 1;
+  }
+
+ private:
+  ShardedLRUCache(const ShardedLRUCache&) = delete;
+  ShardedLRUCache& operator=(const ShardedLRUCache&) = delete;
+
+ private:
+  /* Padded to a cache line so neighbouring shard locks do not share one */
+  struct Shard {
+    explicit Shard(int capacity) : cache(capacity) {}
+    Shard(size_t max_bytes, Weigher weigher) : cache(max_bytes, weigher) {}
+
+    std::mutex lock;
+    LRUCache<TKEY, TVALUE, THASH> cache;
+    char padding[64];
+  };
+
+  uint32_t ShardIndex(const TKEY& key) const {
+    return ShardOfHash(hasher_(key));
+  }
+
+  /* hash is THASH()(key), the shards index by it unmixed */
+  uint32_t ShardOfHash(size_t hash) const {
+    uint64_t h = LRUHashMix(static_cast<uint64_t>(hash));
+    return static_cast<uint32_t>(h & shard_mask_);
+  }
+
+  Shard& GetShard(const TKEY& key) {
+    return *shards_[ShardIndex(key)];
+  }
+
+  /* Counting sort of batch positions by shard, positions of shard s end
+   * up in order[begin[s], begin[s + 1]) */
+  void GroupByShard(const std::vector<uint32_t>& shard_of,
+                    std::vector<uint32_t>* begin,
+                    std::vector<size_t>* order) const;
+
+  static uint32_t RoundUpShardNum(int shard_num) {
+    uint32_t n = 1;
+    while (n < static_cast<uint32_t>(shard_num > 0 ? shard_num : 1))
+      n <<= 1;
+    return n;
+  }
+
+  THASH hasher_;
+  uint32_t shard_mask_;
+  std::unique_ptr<std::unique_ptr<Shard>[]> shards_;
+};  // Class ShardedLRUCache
+
+template <typename TKEY, typename TVALUE, typename THASH>
+ShardedLRUCache<TKEY, TVALUE, THASH>::ShardedLRUCache(int capacity,
+                                                      int shard_num) {
+  uint32_t n = RoundUpShardNum(shard_num);
+  shard_mask_ = n - 1;
+
+  int total = capacity > 0 ? capacity : 0;
+  int per_shard = total / static_cast<int>(n);
+  int remainder = total % static_cast<int>(n);
+
+  shards_.reset(new std::unique_ptr<Shard>[n]);
+  for (uint32_t i = 0; i < n; ++i) {
+    int shard_capacity = per_shard + (static_cast<int>(i) < remainder ? 1 : 0);
+    shards_[i].reset(new Shard(shard_capacity > 0 ? shard_capacity : 1));
+  }
+}
+
+template <typename TKEY, typename TVALUE, typename THASH>
+ShardedLRUCache<TKEY, TVALUE, THASH>::ShardedLRUCache(size_t max_bytes,
+                                                      Weigher weigher,
+                                                      int shard_num) {
+  uint32_t n = RoundUpShardNum(shard_num);
+  shard_mask_ = n - 1;
+
+  shards_.reset(new std::unique_ptr<Shard>[n]);
+  for (uint32_t i = 0; i < n; ++i)
+    shards_[i].reset(new Shard(max_bytes / n + (i < max_bytes % n ? 1 : 0),
+                               weigher));
+}
+
+template <typename TKEY, typename TVALUE, typename THASH>
+template <typename F>
+bool ShardedLRUCache<TKEY, TVALUE, THASH>::Get(const TKEY& key,
+                                               TVALUE* value,
+                                               F function) {
+  Shard& shard = GetShard(key);
+  std::lock_guard<std::mutex> guard(shard.lock);
+
+  TVALUE* cached = shard.cache.Get(key, function);
+  if (nullptr == cached)
+    return false;
+
+  *value = *cached;
+  return true;
+}  // Get
+
+template <typename TKEY, typename TVALUE, typename THASH>
+void ShardedLRUCache<TKEY, TVALUE, THASH>::Set(TKEY key, TVALUE value) {
+  Shard& shard = GetShard(key);
+  std::lock_guard<std::mutex> guard(shard.lock);
+  shard.cache.Set(std::move(key), std::move(value));
+}  // Set
+
+template <typename TKEY, typename TVALUE, typename THASH>
+void ShardedLRUCache<TKEY, TVALUE, THASH>::Set(TKEY key, TVALUE value,
+                                               uint32_t ttl_ms) {
+  Shard& shard = GetShard(key);
+  std::lock_guard<std::mutex> guard(shard.lock);
+  shard.cache.Set(std::move(key), std::move(value), ttl_ms);
+}  // Set
+
+template <typename TKEY, typename TVALUE, typename THASH>
+template <typename M>
+bool ShardedLRUCache<TKEY, TVALUE, THASH>::Update(const TKEY& key,
+                                                  M mutate) {
+  Shard& shard = GetShard(key);
+  std::lock_guard<std::mutex> guard(shard.lock);
+  return shard.cache.Update(key, mutate);
+}  // Update
+
+template <typename TKEY, typename TVALUE, typename THASH>
+bool ShardedLRUCache<TKEY, TVALUE, THASH>::Erase(const TKEY& key) {
+  Shard& shard = GetShard(key);
+  std::lock_guard<std::mutex> guard(shard.lock);
+  return shard.cache.Erase(key);
+}  // Erase
+
+template <typename TKEY, typename TVALUE, typename THASH>
+void ShardedLRUCache<TKEY, TVALUE, THASH>::GroupByShard(
+    const std::vector<uint32_t>& shard_of,
+    std::vector<uint32_t>* begin,
+    std::vector<size_t>* order) const {
+  begin->assign(shard_mask_ + 2, 0);
+  for (size_t i = 0; i < shard_of.size(); ++i)
+    ++(*begin)[shard_of[i] + 1];
+  for (uint32_t s = 0; s <= shard_mask_; ++s)
+    (*begin)[s + 1] += (*begin)[s];
+
+  std::vector<uint32_t> next(begin->begin(), begin->end() - 1);
+  order->resize(shard_of.size());
+  for (size_t i = 0; i < shard_of.size(); ++i)
+    (*order)[next[shard_of[i]]++] = i;
+}  // GroupByShard
+
+template <typename TKEY, typename TVALUE, typename THASH>
+template <typename F>
+void ShardedLRUCache<TKEY, TVALUE, THASH>::MultiGet(
+    const std::vector<TKEY>& keys,
+    std::vector<pair<size_t, TVALUE> >* hits,
+    std::vector<size_t>* misses,
+    F function) {
+  std::vector<size_t> hash_of(keys.size());
+  std::vector<uint32_t> shard_of(keys.size());
+  for (size_t i = 0; i < keys.size(); ++i) {
+    hash_of[i] = hasher_(keys[i]);
+    shard_of[i] = ShardOfHash(hash_of[i]);
+  }
+
+  std::vector<uint32_t> begin;
+  std::vector<size_t> order;
+  GroupByShard(shard_of, &begin, &order);
+
+  hits->reserve(hits->size() + keys.size());
+  for (uint32_t s = 0; s <= shard_mask_; ++s) {
+    if (begin[s] == begin[s + 1])
+      continue;
+
+    Shard& shard = *shards_[s];
+    std::lock_guard<std::mutex> guard(shard.lock);
+    for (uint32_t j = begin[s]; j < begin[s + 1]; ++j) {
+      size_t pos = order[j];
+      TVALUE* cached = shard.cache.Get(hash_of[pos], keys[pos],
+                                       std::equal_to<TKEY>(), function);
+      if (nullptr != cached)
+        hits->push_back(pair<size_t, TVALUE>(pos, *cached));
+      else
+        misses->push_back(pos);
+    }
+  }
+}  // MultiGet
+
+template <typename TKEY, typename TVALUE, typename THASH>
+void ShardedLRUCache<TKEY, TVALUE, THASH>::MultiSet(
+    const std::vector<pair<TKEY, TVALUE> >& items,
+    const std::vector<uint32_t>& ttl_ms) {
+  std::vector<uint32_t> shard_of(items.size());
+  for (size_t i = 0; i < items.size(); ++i)
+    shard_of[i] = ShardIndex(items[i].first);
+
+  std::vector<uint32_t> begin;
+  std::vector<size_t> order;
+  GroupByShard(shard_of, &begin, &order);
+
+  for (uint32_t s = 0; s <= shard_mask_; ++s) {
+    if (begin[s] == begin[s + 1])
+      continue;
+
+    Shard& shard = *shards_[s];
+    std::lock_guard<std::mutex> guard(shard.lock);
+    for (uint32_t j = begin[s]; j < begin[s + 1]; ++j) {
+      size_t pos = order[j];
+      if (ttl_ms.empty() || 0 == ttl_ms[pos])
+        shard.cache.Set(items[pos].first, items[pos].second);
+      else
+        shard.cache.Set(items[pos].first, items[pos].second, ttl_ms[pos]);
+    }
+  }
+}  // MultiSet
+
+template <typename TKEY, typename TVALUE, typename THASH>
+template <typename Visitor>
+void ShardedLRUCache<TKEY, TVALUE, THASH>::ForEach(Visitor visit) {
+  for (uint32_t i = 0; i <= shard_mask_; ++i) {
+    std::lock_guard<std::mutex> guard(shards_[i]->lock);
+    shards_[i]->cache.ForEach(visit);
+  }
+}  // ForEach
+
+template <typename TKEY, typename TVALUE, typename THASH>
+template <typename Visitor>
+void ShardedLRUCache<TKEY, TVALUE, THASH>::ForEachWithTtl(Visitor visit) {
+  for (uint32_t i = 0; i <= shard_mask_; ++i) {
+    std::lock_guard<std::mutex> guard(shards_[i]->lock);
+    shards_[i]->cache.ForEachWithTtl(visit);
+  }
+}  // ForEachWithTtl
+
+template <typename TKEY, typename TVALUE, typename THASH>
+size_t ShardedLRUCache<TKEY, TVALUE, THASH>::Advance(uint64_t now_ms,
+                                                     size_t max_reclaim) {
+  size_t reclaimed = 0;
+  for (uint32_t i = 0; i <= shard_mask_; ++i) {
+    std::lock_guard<std::mutex> guard(shards_[i]->lock);
+    reclaimed += shards_[i]->cache.Advance(now_ms, max_reclaim);
+  }
+  return reclaimed;
+}  // Advance
+
+}  // namespace utils
+
+#endif  // SRC_UTILS_SHARDED_LRU_CACHE_H_
+
+/* vim :set ts=2 sts=2 sw=2 tw=80 et */
@@ -0,0 +1,113 @@
+// Copyright (c) 2016-2017 DONGYUE.ZHANG
+// mail to zhangdy1986(at)gmail.com
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "sharded_lru_cache.h"
+
+// @Author bjzhangdongyue
+// @Brief  Request fan-out on ShardedLRUCache: look a batch of keys up,
+//         then insert the misses, once key by key with Get/Set and once
+//         with MultiGet/MultiSet. Half of the key space fits in the
+//         cache, so about half of every batch misses.
+//
+//         usage: sharded_lru_cache_batch_bench [THREADS [BATCH...]]
+//         One line per api, thread count and batch size:
+//         api threads batch keys_per_sec
+
+namespace {
+
+typedef utils::ShardedLRUCache<uint64_t, uint64_t> Cache;
+
+const int kCapacity = 1 << 18;
+const uint64_t kKeySpace = kCapacity * 2;
+const size_t kKeysPerThread = 2000000;
+const int kShards = 64;
+
+void SingleBatch(Cache* cache, const std::vector<uint64_t>& keys) {
+  uint64_t value = 0;
+  for (size_t i = 0; i < keys.size(); ++i) {
+    if (!cache->Get(keys[i], &value))
+      cache->Set(keys[i], keys[i]);
+  }
+}
+
+void MultiBatch(Cache* cache, const std::vector<uint64_t>& keys) {
+  std::vector<std::pair<size_t, uint64_t> > hits;
+  std::vector<size_t> misses;
+  cache->MultiGet(keys, &hits, &misses);
+
+  std::vector<std::pair<uint64_t, uint64_t> > fetched;
+  fetched.reserve(misses.size());
+  for (size_t i = 0; i < misses.size(); ++i)
+    fetched.push_back(std::make_pair(keys[misses[i]], keys[misses[i]]));
+  cache->MultiSet(fetched);
+}
+
+void Run(const char* api, bool multi, int threads, size_t batch) {
+  Cache cache(kCapacity, kShards);
+  for (uint64_t key = 0; key < kKeySpace; key += 2)
+    cache.Set(key, key);
+
+  std::vector<std::thread> workers;
+  auto start = std::chrono::steady_clock::now();
+  for (int t = 0; t < threads; ++t) {
+    workers.push_back(std::thread([&cache, multi, batch, t]() {
+      std::mt19937_64 random(t + 1);
+      std::vector<uint64_t> keys(batch);
+      for (size_t done = 0; done < kKeysPerThread; done += batch) {
+        for (size_t i = 0; i < batch; ++i)
+          keys[i] = random() % kKeySpace;
+        if (multi)
+          MultiBatch(&cache, keys);
+        else
+          SingleBatch(&cache, keys);
+      }
+    }));
+  }
+  for (size_t t = 0; t < workers.size(); ++t)
+    workers[t].join();
+  double seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+
+  size_t batches = (kKeysPerThread + batch - 1) / batch;
+  double keys = static_cast<double>(batches) * batch * threads;
+  printf("%s %d %zu %.0f\n", api, threads, batch, keys / seconds);
+  fflush(stdout);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  int threads = argc > 1 ? atoi(argv[1]) : 0;
+  if (threads < 1) {
+    threads = static_cast<int>(std::thread::hardware_concurrency());
+    threads = threads > 0 ? threads : 1;
+  }
+  std::vector<size_t> batches;
+  for (int i = 2; i < argc; ++i) {
+    if (atoi(argv[i]) > 0)
+      batches.push_back(atoi(argv[i]));
+  }
+  if (batches.empty()) {
+    batches.push_back(100);
+    batches.push_back(250);
+    batches.push_back(500);
+  }
+
+  printf("api threads batch keys_per_sec\n");
+  for (size_t i = 0; i < batches.size(); ++i) {
+    Run("get_set", false, threads, batches[i]);
+    Run("multi_get_set", true, threads, batches[i]);
+  }
+  return 0;
+}
+
+/* vim :set ts=2 sts=2 sw=2 tw=80 et */
@@ -0,0 +1,120 @@
+// Copyright (c) 2016-2017 DONGYUE.ZHANG
+// mail to zhangdy1986(at)gmail.com
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "lru_cache.h"
+#include "sharded_lru_cache.h"
+
+// @Author bjzhangdongyue
+// @Brief  Throughput of ShardedLRUCache against one LRUCache behind a
+//         single mutex, the way callers used it before. Every thread runs
+//         the same Get/Set mix over a key space twice the capacity, so
+//         about half of the Gets miss and are followed by a Set.
+//
+//         usage: sharded_lru_cache_bench [THREADS...]
+//         One line per cache and thread count:
+//         cache threads ops_per_sec hit_ratio
+
+namespace {
+
+const int kCapacity = 1 << 16;
+const uint64_t kKeySpace = kCapacity * 2;
+const int kOpsPerThread = 1000000;
+const int kShards = 64;
+
+typedef bool (*Expired)(const uint64_t&);
+
+class LockedLRUCache {
+ public:
+  explicit LockedLRUCache(int capacity) : cache_(capacity) {}
+
+  bool Get(uint64_t key, uint64_t* value) {
+    std::lock_guard<std::mutex> guard(lock_);
+    uint64_t* cached = cache_.Get(key, static_cast<Expired>(nullptr));
+    if (nullptr == cached)
+      return false;
+    *value = *cached;
+    return true;
+  }
+
+  void Set(uint64_t key, uint64_t value) {
+    std::lock_guard<std::mutex> guard(lock_);
+    cache_.Set(key, value);
+  }
+
+ private:
+  std::mutex lock_;
+  utils::LRUCache<uint64_t, uint64_t> cache_;
+};
+
+template <typename Cache>
+void Run(const char* name, Cache* cache, int threads) {
+  std::vector<std::thread> workers;
+  std::vector<uint64_t> hits(threads, 0);
+
+  auto start = std::chrono::steady_clock::now();
+  for (int t = 0; t < threads; ++t) {
+    workers.push_back(std::thread([cache, t, &hits]() {
+      std::mt19937_64 random(t + 1);
+      uint64_t hit = 0;
+      for (int i = 0; i < kOpsPerThread; ++i) {
+        uint64_t key = random() % kKeySpace;
+        uint64_t value = 0;
+        if (cache->Get(key, &value))
+          ++hit;
+        else
+          cache->Set(key, key);
+      }
+      hits[t] = hit;
+    }));
+  }
+  for (size_t t = 0; t < workers.size(); ++t)
+    workers[t].join();
+  double seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+
+  uint64_t hit = 0;
+  for (int t = 0; t < threads; ++t)
+    hit += hits[t];
+  double ops = static_cast<double>(kOpsPerThread) * threads;
+  printf("%s %d %.0f %.3f\n", name, threads, ops / seconds, hit / ops);
+  fflush(stdout);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  std::vector<int> threads;
+  for (int i = 1; i < argc; ++i)
+    threads.push_back(atoi(argv[i]));
+  if (threads.empty()) {
+    int cores = static_cast<int>(std::thread::hardware_concurrency());
+    for (int n = 1; n <= 2 * (cores > 0 ? cores : 1) && n <= 64; n *= 2)
+      threads.push_back(n);
+  }
+
+  printf("cache threads ops_per_sec hit_ratio\n");
+  for (size_t i = 0; i < threads.size(); ++i) {
+    if (threads[i] < 1)
+      continue;
+    {
+      LockedLRUCache cache(kCapacity);
+      Run("mutex_lru", &cache, threads[i]);
+    }
+    {
+      utils::ShardedLRUCache<uint64_t, uint64_t> cache(kCapacity, kShards);
+      Run("sharded_lru", &cache, threads[i]);
+    }
+  }
+  return 0;
+}
+
+/* vim :set ts=2 sts=2 sw=2 tw=80 et */
@@ -0,0 +1,345 @@
+// Copyright (c) 2016-2017 DONGYUE.ZHANG
+// mail to zhangdy1986(at)gmail.com
+
+#ifndef SRC_UTILS_SHM_LRU_CACHE_H_
+#define SRC_UTILS_SHM_LRU_CACHE_H_
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+#include "flat_lru_cache.h"
+#include "lru_cache.h"
+
+// @Author bjzhangdongyue
+// @Brief  LRU cache shared by all processes of a host
+// @Note   threadsafe and process safe
+//
+// The whole cache lives in one POSIX shared memory segment: a header with
+// a process shared robust mutex, then a fixed entry array and an open
+// addressing index, run by the FlatLRUTable of FlatLRUCache. Links are
+// array indices, never pointers, so every process may map the segment at
+// a different address. TKEY/TVALUE must be trivial, no constructor runs
+// on the segment, and every process must be the same binary (std::hash
+// has to agree).
+//
+// Attaching takes an flock on the segment while it sizes, maps and checks
+// it, and drops it right after: the lock belongs to the open file, which
+// the mapping keeps alive after close. The kernel also releases it when
+// its owner dies. The first process to get it sizes and formats the
+// segment, so a creator dying half way only leaves the job to the next.
+//
+// A worker dying while it holds the lock leaves the mutex EOWNERDEAD. The
+// next locker drops the cache contents, which may be half updated, marks
+// the mutex consistent and carries on with an empty cache.
+
+namespace utils {
+
+template <typename TKEY, typename TVALUE,
+          typename THASH = std::hash<TKEY>,
+          typename TEQUAL = std::equal_to<TKEY> >
+class ShmLRUCache {
+  // std::is_trivially_copyable is missing from gcc 4.8
+  static_assert(std::is_trivial<TKEY>::value &&
+                std::is_trivial<TVALUE>::value,
+                "ShmLRUCache needs trivial keys and values");
+
+ public:
+  /* Opens the segment, creating and initializing it if it does not exist
+   * or its creator died before finishing.
+   * @params[in] name : shm_open name, such as "/rank_cache"
+   * @params[in] capacity : must be the same in every process
+   * @throw std::runtime_error on system errors or a layout mismatch
+   * */
+  ShmLRUCache(const std::string& name, uint32_t capacity);
+
+  /* Unmaps only, the segment outlives the processes */
+  ~ShmLRUCache();
+
+  /* Same semantics as ShardedLRUCache::Get, the value is copied out */
+  template <typename F>
+  bool Get(const TKEY& key, TVALUE* value, F function);
+
+  bool Get(const TKEY& key, TVALUE* value) {
+    return Get(key, value, static_cast<bool(*)(const TVALUE&)>(nullptr));
+  }
+
+  void Set(const TKEY& key, const TVALUE& value);
+
+  bool Erase(const TKEY& key);
+
+  LRUStats GetStats() const {
+    return header_->counters.Snapshot();
+  }
+
+  /* Times the cache was dropped after a worker died holding the lock */
+  uint64_t recoveries() const {
+    return header_->recoveries.load(std::memory_order_relaxed);
+  }
+
+  /* Removes the segment name, mapped processes keep their mapping */
+  static bool Unlink(const std::string& name) {
+    return 0 == shm_unlink(name.c_str());
+  }
+
+ private:
+  ShmLRUCache(const ShmLRUCache&) = delete;
+  ShmLRUCache& operator=(const ShmLRUCache&) = delete;
+
+ private:
+  static const uint32_t kMagic = 0x4c525553;  // "SURL"
+
+  struct Entry {
+    TKEY key;
+    TVALUE value;
+    uint32_t prev;
+    uint32_t next;
+  };
+
+  using Table = FlatLRUTable<Entry>;
+  using Slot = typename Table::Slot;
+
+  struct Header {
+    std::atomic<uint32_t> ready;
+    uint32_t magic;
+    uint32_t capacity;
+    uint32_t entry_size;
+    pthread_mutex_t lock;
+    FlatLRUState lru;
+    LRUCounters counters;
+    std::atomic<uint64_t> recoveries;
+  };
+
+  /* Lock guard that repairs the cache after a dead owner */
+  class Locker {
+   public:
+    explicit Locker(ShmLRUCache* cache) : cache_(cache) {
+      int rc = pthread_mutex_lock(&cache_->header_->lock);
+      if (EOWNERDEAD == rc) {
+        cache_->Reset();
+        cache_->header_->recoveries.fetch_add(1, std::memory_order_relaxed);
+        pthread_mutex_consistent(&cache_->header_->lock);
+      } else if (0 != rc) {
+        throw std::runtime_error("SHM_LRU_CACHE:lock failed");
+      }
+    }
+
+    ~Locker() {
+      pthread_mutex_unlock(&cache_->header_->lock);
+    }
+
+   private:
+    ShmLRUCache* cache_;
+  };
+
+  static size_t EntriesOffset() {
+    return (sizeof(Header) + 63) & ~static_cast<size_t>(63);
+  }
+
+  static size_t IndexOffset(uint32_t capacity) {
+    return (EntriesOffset() + sizeof(Entry) * capacity + 63) &
+        ~static_cast<size_t>(63);
+  }
+
+  static size_t SegmentSize(uint32_t capacity) {
+    return IndexOffset(capacity) + sizeof(Slot) * Table::IndexSize(capacity);
+  }
+
+  uint32_t HashOf(const TKEY& key) const {
+    return static_cast<uint32_t>(
+        LRUHashMix(static_cast<uint64_t>(hasher_(key))));
+  }
+
+  /* Size, map and if needed format the segment, caller holds the flock
+   * @return error message, empty on success */
+  std::string Map(int fd, uint32_t capacity);
+
+  /* First process: build the header and the empty cache */
+  void Format(uint32_t capacity);
+
+  /* Empty the cache, caller holds the lock */
+  void Reset() {
+    table_.Clear(header_->capacity);
+  }
+
+  THASH hasher_;
+  TEQUAL equal_;
+  size_t mapped_size_;
+  Header* header_;
+  Entry* entries_;
+  Table table_;
+};  // Class ShmLRUCache
+
+template <typename TKEY, typename TVALUE, typename THASH, typename TEQUAL>
+ShmLRUCache<TKEY, TVALUE, THASH, TEQUAL>::ShmLRUCache(
+    const std::string& name, uint32_t capacity)
+    : mapped_size_(SegmentSize(capacity > 0 ? capacity : 1)),
+      header_(nullptr) {
+  if (0 == capacity)
+    capacity = 1;
+
+  int fd = shm_open(name.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd < 0)
+    throw std::runtime_error("SHM_LRU_CACHE:shm_open " + name + " failed");
+
+  int rc = 0;
+  while (0 != (rc = flock(fd, LOCK_EX)) && EINTR == errno) {
+  }
+  std::string error = 0 == rc ? Map(fd, capacity) : "flock failed";
+  // close alone would keep it, the mapping still references the file
+  flock(fd, LOCK_UN);
+  close(fd);
+  if (!error.empty())
+    throw std::runtime_error("SHM_LRU_CACHE:" + name + " " + error);
+}
+
+template <typename TKEY, typename TVALUE, typename THASH, typename TEQUAL>
+std::string ShmLRUCache<TKEY, TVALUE, THASH, TEQUAL>::Map(int fd,
+                                                          uint32_t capacity) {
+  struct stat st;
+  if (0 != fstat(fd, &st))
+    return "fstat failed";
+
+  // Empty when just created, or when the creator died before sizing it
+  if (0 == st.st_size) {
+    if (0 != ftruncate(fd, mapped_size_))
+      return "ftruncate failed";
+    st.st_size = mapped_size_;
+  }
+  // Checked before mapping, touching pages past the end raises SIGBUS
+  if (static_cast<size_t>(st.st_size) != mapped_size_)
+    return "layout mismatch";
+
+  void* addr = mmap(nullptr, mapped_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fd, 0);
+  if (MAP_FAILED == addr)
+    return "mmap failed";
+
+  header_ = static_cast<Header*>(addr);
+  entries_ = reinterpret_cast<Entry*>(
+      static_cast<char*>(addr) + EntriesOffset());
+  table_.Attach(&header_->lru, entries_, reinterpret_cast<Slot*>(
+      static_cast<char*>(addr) + IndexOffset(capacity)), capacity);
+
+  // Formatting happens under the flock, a segment that is not ready here
+  // lost its creator half way
+  if (!header_->ready.load(std::memory_order_acquire))
+    Format(capacity);
+
+  if (kMagic != header_->magic || capacity != header_->capacity ||
+      sizeof(Entry) != header_->entry_size) {
+    munmap(addr, mapped_size_);
+    header_ = nullptr;
+    return "layout mismatch";
+  }
+  return "";
+}  // Map
+
+template <typename TKEY, typename TVALUE, typename THASH, typename TEQUAL>
+ShmLRUCache<TKEY, TVALUE, THASH, TEQUAL>::~ShmLRUCache() {
+  if (header_)
+    munmap(header_, mapped_size_);
+}
+
+template <typename TKEY, typename TVALUE, typename THASH, typename TEQUAL>
+void ShmLRUCache<TKEY, TVALUE, THASH, TEQUAL>::Format(uint32_t capacity) {
+  new (header_) Header();
+  header_->magic = kMagic;
+  header_->capacity = capacity;
+  header_->entry_size = sizeof(Entry);
+  header_->recoveries.store(0, std::memory_order_relaxed);
+
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(&header_->lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+
+  Reset();
+  header_->ready.store(1, std::memory_order_release);
+}  // Format
+
+template <typename TKEY, typename TVALUE, typename THASH, typename TEQUAL>
+template <typename F>
+bool ShmLRUCache<TKEY, TVALUE, THASH, TEQUAL>::Get(const TKEY& key,
+                                                   TVALUE* value,
+                                                   F function) {
+  uint32_t tag = HashOf(key);
+  Locker guard(this);
+
+  uint32_t slot = table_.Find(key, tag, equal_);
+  if (Table::kNil == slot) {
+    header_->counters.Miss();
+    return false;
+  }
+
+  uint32_t idx = table_.EntryAt(slot);
+  if (nullptr != function) {
+    if (function(entries_[idx].value)) {
+      header_->counters.Expire();
+      table_.Delete(slot);
+      return false;
+    }
+  }
+
+  table_.Touch(idx);
+  header_->counters.Hit();
+
+  *value = entries_[idx].value;
+  return true;
+}  // Get
+
+template <typename TKEY, typename TVALUE, typename THASH, typename TEQUAL>
+void ShmLRUCache<TKEY, TVALUE, THASH, TEQUAL>::Set(const TKEY& key,
+                                                   const TVALUE& value) {
+  uint32_t tag = HashOf(key);
+  Locker guard(this);
+
+  uint32_t slot = table_.Find(key, tag, equal_);
+  if (Table::kNil != slot) {
+    table_.Touch(table_.EntryAt(slot));
+    return;
+  }
+
+  if (header_->lru.size == header_->capacity) {
+    const TKEY& lru = entries_[header_->lru.tail].key;
+    table_.Delete(table_.Find(lru, HashOf(lru), equal_));
+    header_->counters.Evict();
+  }
+
+  uint32_t idx = table_.Insert(tag);
+  entries_[idx].key = key;
+  entries_[idx].value = value;
+}  // Set
+
+template <typename TKEY, typename TVALUE, typename THASH, typename TEQUAL>
+bool ShmLRUCache<TKEY, TVALUE, THASH, TEQUAL>::Erase(const TKEY& key) {
+  uint32_t tag = HashOf(key);
+  Locker guard(this);
+
+  uint32_t slot = table_.Find(key, tag, equal_);
+  if (Table::kNil == slot)
+    return false;
+
+  table_.Delete(slot);
+  return true;
+}  // Erase
+
+}  // namespace utils
+
+#endif  // SRC_UTILS_SHM_LRU_CACHE_H_
+
+/* vim :set ts=2 sts=2 sw=2 tw=80 et */
@@ -0,0 +1,115 @@
+// Copyright (c) 2016-2017 DONGYUE.ZHANG
+// mail to zhangdy1986(at)gmail.com
+
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "shm_lru_cache.h"
+
+// @Author bjzhangdongyue
+// @Brief  Multi process checks of ShmLRUCache, each in forked children:
+//         two processes attached at once see each other's writes, and a
+//         worker SIGKILLed inside the lock leaves a cache the others
+//         recover and keep using. A child that hangs is killed by alarm.
+//
+//         usage: shm_lru_cache_test
+//         Prints one line per check, exits 1 if one failed.
+
+namespace {
+
+typedef utils::ShmLRUCache<int, int> Cache;
+
+const char kName[] = "/shm_lru_cache_test";
+const unsigned kTimeoutSeconds = 10;
+
+int failures = 0;
+
+void Check(bool ok, const char* what) {
+  printf("%s %s\n", ok ? "ok  " : "FAIL", what);
+  if (!ok)
+    ++failures;
+}
+
+/* Run body in a child with a deadline
+ * @return true if it exited with 0 */
+template <typename F>
+bool InChild(F body) {
+  pid_t pid = fork();
+  if (0 == pid) {
+    alarm(kTimeoutSeconds);
+    _exit(body() ? 0 : 1);
+  }
+  int status = 0;
+  waitpid(pid, &status, 0);
+  return WIFEXITED(status) && 0 == WEXITSTATUS(status);
+}
+
+/* The parent keeps its mapping while a child attaches, reads what the
+ * parent wrote and writes back */
+void TwoProcesses() {
+  Cache::Unlink(kName);
+  Cache parent(kName, 64);
+  parent.Set(1, 100);
+
+  bool child_ok = InChild([]() {
+    Cache child(kName, 64);
+    int value = 0;
+    if (!child.Get(1, &value) || 100 != value)
+      return false;
+    child.Set(2, 200);
+    return true;
+  });
+  Check(child_ok, "second process attaches while the first is mapped");
+
+  int value = 0;
+  Check(parent.Get(2, &value) && 200 == value,
+        "first process sees the second one's write");
+  Cache::Unlink(kName);
+}
+
+/* Kill writers until one dies inside the lock, then check the survivors
+ * repair the cache and go on */
+void KilledInsideLock() {
+  Cache::Unlink(kName);
+  Cache cache(kName, 1024);
+  for (int attempt = 0; attempt < 200 && 0 == cache.recoveries();
+       ++attempt) {
+    pid_t pid = fork();
+    if (0 == pid) {
+      Cache writer(kName, 1024);
+      for (int i = 0; ; ++i)
+        writer.Set(i % 4096, i);
+    }
+    usleep(2000 + attempt * 100);
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+    int value = 0;
+    cache.Get(attempt, &value);  // the next locker does the repair
+  }
+  Check(cache.recoveries() > 0, "a writer killed inside the lock is seen");
+
+  cache.Set(7, 70);
+  bool child_ok = InChild([]() {
+    Cache child(kName, 1024);
+    int value = 0;
+    return child.Get(7, &value) && 70 == value;
+  });
+  Check(child_ok, "the cache works across processes after the recovery");
+  Cache::Unlink(kName);
+}
+
+}  // namespace
+
+int main() {
+  TwoProcesses();
+  KilledInsideLock();
+  return 0 == failures ? 0 : 1;
+}
+
+/* vim :set ts=2 sts=2 sw=2 tw=80 et */
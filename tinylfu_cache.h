@@ -0,0 +1,315 @@
+// Copyright (c) 2016-2017 DONGYUE.ZHANG
+// mail to zhangdy1986(at)gmail.com
+
+#ifndef SRC_UTILS_TINYLFU_CACHE_H_
+#define SRC_UTILS_TINYLFU_CACHE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "lru_cache.h"
+
+// @Author bjzhangdongyue
+// @Brief  W-TinyLFU cache: scan resistant replacement for LRUCache
+// @Note   not threadsafe, need to do mutual exclusion when Get or Set
+//
+// New keys land in a small window LRU (1% of the capacity). Keys falling
+// out of the window compete for a place in the main segmented LRU
+// (probation 20% / protected 80%) against the probation victim, and the
+// one seen more often according to a count-min sketch wins. A one-off
+// batch scan then churns through the window but cannot push the hot set
+// out of the main area.
+
+namespace utils {
+
+/* @Brief Count-min sketch of 4 bit counters, 4 rows packed in one table.
+ *        Counters are halved every 10 x capacity increments, so the
+ *        frequencies follow recent traffic.
+ * */
+template <typename TKEY, typename THASH = std::hash<TKEY> >
+class FrequencySketch {
+ public:
+  explicit FrequencySketch(uint32_t capacity);
+
+  void Increment(const TKEY& key);
+
+  /* @return estimated frequency, 0 - 15 */
+  uint32_t Frequency(const TKEY& key) const;
+
+ private:
+  static const int kRows = 4;
+
+  uint64_t HashOf(const TKEY& key) const {
+    return LRUHashMix(static_cast<uint64_t>(hasher_(key)));
+  }
+
+  /* Counter index of row i, derived from one hash by double hashing */
+  uint64_t IndexOf(uint64_t hash, int i) const {
+    uint64_t h = hash + static_cast<uint64_t>(i) * ((hash >> 32) | 1);
+    return LRUHashMix(h + i) & counter_mask_;
+  }
+
+  void Reset();
+
+  THASH hasher_;
+  uint64_t counter_mask_;
+  uint32_t additions_;
+  uint32_t sample_size_;
+  std::vector<uint64_t> table_;
+};  // Class FrequencySketch
+
+template <typename TKEY, typename TVALUE>
+class TinyLFUCache {
+ public:
+  explicit TinyLFUCache(int capacity);
+
+  /* Same semantics as LRUCache::Get */
+  template <typename F>
+  TVALUE* Get(const TKEY& key, F function);
+
+  TVALUE* Get(const TKEY& key) {
+    return Get(key, static_cast<bool(*)(const TVALUE&)>(nullptr));
+  }
+
+  /* key and value are moved into the cache, the key is stored once and
+   * the region lists point at it. Counts as an access for admission. */
+  void Set(TKEY key, TVALUE value);
+
+  using RETURN = typename LRUCache<TKEY, TVALUE>::RETURN;
+
+  /* Same semantics as LRUCache::Lookup */
+  template <typename F>
+  typename RETURN::type Lookup(const TKEY& key, TVALUE** value,
+                               F function);
+
+  /* evictions also count candidates refused by the admission filter */
+  LRUStats GetStats() const {
+    return counters_.Snapshot();
+  }
+
+  size_t size() const {
+    return cache_.size();
+  }
+
+ private:
+  TinyLFUCache(const TinyLFUCache&) = delete;
+  TinyLFUCache& operator=(const TinyLFUCache&) = delete;
+
+ private:
+  enum Region {
+    WINDOW = 0,
+    PROBATION = 1,
+    PROTECTED = 2
+  };
+
+  using L = std::list<const TKEY*>;
+
+  struct Entry {
+    explicit Entry(TVALUE&& v) : value(std::move(v)), region(WINDOW) {}
+
+    TVALUE value;
+    typename L::iterator pos;  // node of the key pointer in lists_[region]
+    Region region;
+  };
+
+  using HPL = std::unordered_map<TKEY, Entry>;
+
+  /* Move the entry to the MRU end of region */
+  void MoveTo(Entry* entry, Region region);
+
+  void Touch(Entry* entry);
+
+  /* Window overflowed: admit its LRU key to main, or drop it */
+  void EvictFromWindow();
+
+  void Delete(typename HPL::iterator it);
+
+  HPL cache_;
+  L lists_[3];
+  size_t caps_[3];
+  size_t main_cap_;
+  FrequencySketch<TKEY> sketch_;
+  LRUCounters counters_;
+};  // Class TinyLFUCache
+
+template <typename TKEY, typename THASH>
+FrequencySketch<TKEY, THASH>::FrequencySketch(uint32_t capacity)
+    : additions_(0) {
+  uint64_t words = 1;
+  while (words * 16 < static_cast<uint64_t>(capacity) * kRows)
+    words <<= 1;
+  counter_mask_ = words * 16 - 1;
+  sample_size_ = capacity < 0x0ccccccc ? capacity * 10 : 0x7fffffff;
+  if (sample_size_ == 0)
+    sample_size_ = 10;
+  table_.assign(words, 0);
+}
+
+template <typename TKEY, typename THASH>
+void FrequencySketch<TKEY, THASH>::Increment(const TKEY& key) {
+  uint64_t hash = HashOf(key);
+  bool added = false;
+  for (int i = 0; i < kRows; ++i) {
+    uint64_t idx = IndexOf(hash, i);
+    uint64_t& word = table_[idx >> 4];
+    int shift = static_cast<int>(idx & 15) << 2;
+    if (((word >> shift) & 0xf) != 0xf) {
+      word += 1ULL << shift;
+      added = true;
+    }
+  }
+
+  if (added && ++additions_ >= sample_size_)
+    Reset();
+}  // Increment
+
+template <typename TKEY, typename THASH>
+uint32_t FrequencySketch<TKEY, THASH>::Frequency(const TKEY& key) const {
+  uint64_t hash = HashOf(key);
+  uint32_t freq = 0xf;
+  for (int i = 0; i < kRows; ++i) {
+    uint64_t idx = IndexOf(hash, i);
+    int shift = static_cast<int>(idx & 15) << 2;
+    uint32_t count = static_cast<uint32_t>((table_[idx >> 4] >> shift) & 0xf);
+    if (count < freq)
+      freq = count;
+  }
+  return freq;
+}  // Frequency
+
+template <typename TKEY, typename THASH>
+void FrequencySketch<TKEY, THASH>::Reset() {
+  for (size_t i = 0; i < table_.size(); ++i)
+    table_[i] = (table_[i] >> 1) & 0x7777777777777777ULL;
+  additions_ /= 2;
+}  // Reset
+
+template <typename TKEY, typename TVALUE>
+TinyLFUCache<TKEY, TVALUE>::TinyLFUCache(int capacity)
+    : sketch_(capacity > 0 ? capacity : 1) {
+  size_t total = capacity > 1 ? capacity : 2;
+  caps_[WINDOW] = total / 100 > 0 ? total / 100 : 1;
+  main_cap_ = total - caps_[WINDOW];
+  caps_[PROTECTED] = main_cap_ * 4 / 5;
+  caps_[PROBATION] = main_cap_ - caps_[PROTECTED];
+}
+
+template <typename TKEY, typename TVALUE>
+template <typename F>
+TVALUE* TinyLFUCache<TKEY, TVALUE>::Get(const TKEY& key, F function) {
+  TVALUE* value = nullptr;
+  Lookup(key, &value, function);
+  return value;
+}  // Get
+
+template <typename TKEY, typename TVALUE>
+template <typename F>
+typename TinyLFUCache<TKEY, TVALUE>::RETURN::type
+TinyLFUCache<TKEY, TVALUE>::Lookup(const TKEY& key, TVALUE** value,
+                                   F function) {
+  sketch_.Increment(key);
+  auto it = cache_.find(key);
+
+  if (it == cache_.end()) {
+    counters_.Miss();
+    LRUCache<TKEY, TVALUE>::SetStatus(RETURN::MISS);
+    return RETURN::MISS;
+  }
+
+  if (nullptr != function) {
+    LRUCache<TKEY, TVALUE>::SetStatus(RETURN::EXPIRED);
+    if (function(it->second.value)) {
+      counters_.Expire();
+      Delete(it);
+      return RETURN::EXPIRED;
+    }
+  }
+
+  Touch(&it->second);
+  counters_.Hit();
+  LRUCache<TKEY, TVALUE>::SetStatus(RETURN::HIT);
+
+  *value = &(it->second.value);
+  return RETURN::HIT;
+}  // Lookup
+
+template <typename TKEY, typename TVALUE>
+void TinyLFUCache<TKEY, TVALUE>::Set(TKEY key, TVALUE value) {
+  sketch_.Increment(key);
+  auto it = cache_.find(key);
+
+  if (it != cache_.end()) {
+    Touch(&it->second);
+    return;
+  }
+
+  it = cache_.emplace(std::piecewise_construct,
+                      std::forward_as_tuple(std::move(key)),
+                      std::forward_as_tuple(std::move(value))).first;
+  L& window = lists_[WINDOW];
+  window.push_front(&it->first);
+  it->second.pos = window.begin();
+
+  if (window.size() > caps_[WINDOW])
+    EvictFromWindow();
+}  // Set
+
+template <typename TKEY, typename TVALUE>
+void TinyLFUCache<TKEY, TVALUE>::MoveTo(Entry* entry, Region region) {
+  lists_[region].splice(lists_[region].begin(), lists_[entry->region],
+                        entry->pos);
+  entry->region = region;
+}  // MoveTo
+
+template <typename TKEY, typename TVALUE>
+void TinyLFUCache<TKEY, TVALUE>::Touch(Entry* entry) {
+  if (PROBATION != entry->region) {
+    MoveTo(entry, entry->region);
+    return;
+  }
+
+  // Second hit in main: promote, and demote the protected LRU if full
+  MoveTo(entry, PROTECTED);
+  if (lists_[PROTECTED].size() > caps_[PROTECTED])
+    MoveTo(&cache_.find(*lists_[PROTECTED].back())->second, PROBATION);
+}  // Touch
+
+template <typename TKEY, typename TVALUE>
+void TinyLFUCache<TKEY, TVALUE>::EvictFromWindow() {
+  auto candidate = cache_.find(*lists_[WINDOW].back());
+
+  if (lists_[PROBATION].size() + lists_[PROTECTED].size() < main_cap_) {
+    MoveTo(&candidate->second, PROBATION);
+    return;
+  }
+
+  Region victim_region = lists_[PROBATION].empty() ? PROTECTED : PROBATION;
+  auto victim = cache_.find(*lists_[victim_region].back());
+
+  if (sketch_.Frequency(candidate->first) >
+      sketch_.Frequency(victim->first)) {
+    Delete(victim);
+    MoveTo(&candidate->second, PROBATION);
+  } else {
+    Delete(candidate);
+  }
+  counters_.Evict();
+}  // EvictFromWindow
+
+template <typename TKEY, typename TVALUE>
+void TinyLFUCache<TKEY, TVALUE>::Delete(typename HPL::iterator it) {
+  lists_[it->second.region].erase(it->second.pos);
+  cache_.erase(it);
+}  // Delete
+
+}  // namespace utils
+
+#endif  // SRC_UTILS_TINYLFU_CACHE_H_
+
+/* vim :set ts=2 sts=2 sw=2 tw=80 et */
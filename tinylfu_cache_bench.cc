@@ -0,0 +1,116 @@
+// Copyright (c) 2016-2017 DONGYUE.ZHANG
+// mail to zhangdy1986(at)gmail.com
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "lru_cache.h"
+#include "tinylfu_cache.h"
+
+// @Author bjzhangdongyue
+// @Brief  Trace replay of LRUCache and TinyLFUCache. Every request is a
+//         Get followed by a Set on miss, the way a cache aside caller
+//         drives them, and both caches replay the same trace.
+//
+//         usage: tinylfu_cache_bench [CAPACITY [TRACE]]
+//         TRACE has one integer key per line. Without it a Zipf(0.9)
+//         trace over 1M keys is generated, with a scan of 4 x CAPACITY
+//         never repeated keys every 1M requests, the batch job pattern
+//         that flushes a plain LRU.
+//         One line per cache: cache requests hit_ratio ops_per_sec
+
+namespace {
+
+const uint64_t kZipfKeys = 1000000;
+const double kZipfSkew = 0.9;
+const size_t kRequests = 10000000;
+const size_t kScanEvery = 1000000;
+
+std::vector<uint64_t> GenerateTrace(uint64_t capacity) {
+  std::vector<double> cdf(kZipfKeys);
+  double sum = 0;
+  for (uint64_t i = 0; i < kZipfKeys; ++i) {
+    sum += 1.0 / std::pow(static_cast<double>(i + 1), kZipfSkew);
+    cdf[i] = sum;
+  }
+
+  std::mt19937_64 random(1);
+  std::uniform_real_distribution<double> uniform(0, sum);
+  std::vector<uint64_t> trace;
+  trace.reserve(kRequests);
+  uint64_t scan_key = kZipfKeys;
+  while (trace.size() < kRequests) {
+    if (!trace.empty() && 0 == trace.size() % kScanEvery) {
+      for (uint64_t i = 0; i < capacity * 4; ++i)
+        trace.push_back(scan_key++);
+    }
+    trace.push_back(std::lower_bound(cdf.begin(), cdf.end(),
+                                     uniform(random)) - cdf.begin());
+  }
+  return trace;
+}
+
+bool ReadTrace(const char* path, std::vector<uint64_t>* trace) {
+  std::ifstream in(path);
+  uint64_t key = 0;
+  while (in >> key)
+    trace->push_back(key);
+  return in.eof() && !trace->empty();
+}
+
+template <typename Cache>
+void Replay(const char* name, int capacity,
+            const std::vector<uint64_t>& trace) {
+  typedef bool (*Expired)(const uint64_t&);
+  Cache cache(capacity);
+  uint64_t hits = 0;
+
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < trace.size(); ++i) {
+    if (nullptr != cache.Get(trace[i], static_cast<Expired>(nullptr)))
+      ++hits;
+    else
+      cache.Set(trace[i], trace[i]);
+  }
+  double seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+
+  printf("%s %zu %.4f %.0f\n", name, trace.size(),
+         static_cast<double>(hits) / trace.size(), trace.size() / seconds);
+  fflush(stdout);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  int capacity = argc > 1 ? atoi(argv[1]) : 0;
+  if (capacity <= 0)
+    capacity = 10000;
+
+  std::vector<uint64_t> trace;
+  if (argc > 2) {
+    if (!ReadTrace(argv[2], &trace)) {
+      std::cerr << argv[2] << ": unable to read the trace" << std::endl;
+      return 1;
+    }
+  } else {
+    trace = GenerateTrace(capacity);
+  }
+
+  printf("cache requests hit_ratio ops_per_sec\n");
+  Replay<utils::LRUCache<uint64_t, uint64_t> >("lru", capacity, trace);
+  Replay<utils::TinyLFUCache<uint64_t, uint64_t> >("tinylfu", capacity,
+                                                   trace);
+  return 0;
+}
+
+/* vim :set ts=2 sts=2 sw=2 tw=80 et */